@@ -0,0 +1,214 @@
+/*
+ *
+ *      This module implements arenas: request scoped allocation by bumping a pointer
+ *      through whole superblocks, with no per-object headers and no per-object free.
+ *
+ *      Arena superblocks are raw superblock sized regions from core. Their buffer is
+ *      never carved into blocks, so instead of going back to the Hoard heaps (which
+ *      would mean rebuilding a free block stack per superblock) they are recycled
+ *      through a small shared pool, spliced in and out as whole chains.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "memory_allocator.h"
+#include "assert_static.h"
+
+/* alignment of every arena allocation, as malloc gives on x86 */
+#define ARENA_ALIGNMENT 16
+
+/* superblocks kept in the shared pool, the rest goes back to the OS */
+#define ARENA_POOL_MAX 64
+
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((uintptr_t) (a) - 1))
+
+/* an allocation too big for a superblock gets its own mapping */
+typedef struct arena_large {
+    struct arena_large *_pNext;
+    size_t _length;
+} arena_large_t;
+
+struct mtmm_arena {
+    /* chain of superblocks linked through _meta._pNxtSBlk, first one holds this struct */
+    superblock_t *_pFirst, *_pCurrent;
+    unsigned int _superblocks;
+
+    /* free space left in the current superblock */
+    uintptr_t _bump, _end;
+
+    arena_large_t *_pLarge;
+};
+
+static pthread_mutex_t arenaPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static superblock_t *arenaPool;
+static unsigned int arenaPoolLength;
+
+static superblock_t *_take_superblock(void)
+{
+    superblock_t *pSb = NULL;
+
+    assert(pthread_mutex_lock(&arenaPoolLock) == 0);
+    if (arenaPool != NULL) {
+        pSb = arenaPool;
+        arenaPool = pSb->_meta._pNxtSBlk;
+        arenaPoolLength--;
+    }
+    assert(pthread_mutex_unlock(&arenaPoolLock) == 0);
+
+    if (pSb == NULL) {
+        pSb = getCore(SUPERBLOCK_BYTES);
+        if (pSb == NULL) {
+            return NULL;
+        }
+    }
+
+    pSb->_meta._pNxtSBlk = NULL;
+    return pSb;
+}
+
+/* give back a chain of count superblocks from first to last */
+static void _return_superblocks(superblock_t *first, superblock_t *last, unsigned int count)
+{
+    superblock_t *pSb = NULL;
+
+    assert(pthread_mutex_lock(&arenaPoolLock) == 0);
+    if (arenaPoolLength + count <= ARENA_POOL_MAX) {
+        /* the whole chain fits - splice it in */
+        last->_meta._pNxtSBlk = arenaPool;
+        arenaPool = first;
+        arenaPoolLength += count;
+        first = NULL;
+    }
+    assert(pthread_mutex_unlock(&arenaPoolLock) == 0);
+
+    while (first != NULL) {
+        pSb = first;
+        first = (pSb == last) ? NULL : pSb->_meta._pNxtSBlk;
+        freeCore(pSb, SUPERBLOCK_BYTES);
+    }
+}
+
+/* give the whole pool back to the OS, under memory pressure */
+void arenaPoolFlush(void)
+{
+    superblock_t *pSb = NULL, *pNext = NULL;
+
+    assert(pthread_mutex_lock(&arenaPoolLock) == 0);
+    pSb = arenaPool;
+    arenaPool = NULL;
+    arenaPoolLength = 0;
+    assert(pthread_mutex_unlock(&arenaPoolLock) == 0);
+
+    for (; pSb != NULL; pSb = pNext) {
+        pNext = pSb->_meta._pNxtSBlk;
+        freeCore(pSb, SUPERBLOCK_BYTES);
+    }
+}
+
+static void _use_superblock(mtmm_arena_t *arena, superblock_t *pSb, uintptr_t start)
+{
+    arena->_pCurrent = pSb;
+    arena->_bump = start;
+    arena->_end = (uintptr_t) pSb->_buff + SUPERBLOCK_SIZE;
+}
+
+static void _free_large(mtmm_arena_t *arena)
+{
+    arena_large_t *pLarge = arena->_pLarge, *pNext = NULL;
+
+    for (; pLarge != NULL; pLarge = pNext) {
+        pNext = pLarge->_pNext;
+        freeCore(pLarge, pLarge->_length);
+    }
+    arena->_pLarge = NULL;
+}
+
+mtmm_arena_t *mtmm_arena_create(void)
+{
+    superblock_t *pSb = _take_superblock();
+    mtmm_arena_t *arena = NULL;
+
+    if (pSb == NULL) {
+        return NULL;
+    }
+
+    /* the arena itself lives at the start of its first superblock */
+    arena = (mtmm_arena_t *) pSb->_buff;
+    arena->_pFirst = pSb;
+    arena->_superblocks = 1;
+    arena->_pLarge = NULL;
+    _use_superblock(arena, pSb, (uintptr_t) (arena + 1));
+
+    return arena;
+}
+
+void *mtmm_arena_alloc(mtmm_arena_t *arena, size_t size)
+{
+    uintptr_t p = ALIGN_UP(arena->_bump, ARENA_ALIGNMENT);
+    superblock_t *pSb = NULL;
+    arena_large_t *pLarge = NULL;
+    size_t header = ALIGN_UP(sizeof(arena_large_t), ARENA_ALIGNMENT), length;
+
+    if (size == 0) {
+        size = 1;
+    }
+
+    if (p + size <= arena->_end && p + size > p) {
+        arena->_bump = p + size;
+        return (void *) p;
+    }
+
+    if (size > SUPERBLOCK_SIZE / 2) {
+        /* a size near SIZE_MAX would wrap the length to a mapping of a few bytes */
+        if (size > SIZE_MAX - header - getpagesize()) {
+            return NULL;
+        }
+        length = header + size;
+        pLarge = getCore(length);
+        if (pLarge == NULL) {
+            return NULL;
+        }
+        pLarge->_length = length;
+        pLarge->_pNext = arena->_pLarge;
+        arena->_pLarge = pLarge;
+        return (char *) pLarge + header;
+    }
+
+    pSb = _take_superblock();
+    if (pSb == NULL) {
+        return NULL;
+    }
+    arena->_pCurrent->_meta._pNxtSBlk = pSb;
+    arena->_superblocks++;
+    _use_superblock(arena, pSb, (uintptr_t) pSb->_buff);
+
+    p = ALIGN_UP(arena->_bump, ARENA_ALIGNMENT);
+    arena->_bump = p + size;
+    return (void *) p;
+}
+
+void mtmm_arena_reset(mtmm_arena_t *arena)
+{
+    superblock_t *first = arena->_pFirst;
+
+    /* keep the first superblock, the rest of the chain goes back in one splice */
+    if (first->_meta._pNxtSBlk != NULL) {
+        _return_superblocks(first->_meta._pNxtSBlk, arena->_pCurrent, arena->_superblocks - 1);
+        first->_meta._pNxtSBlk = NULL;
+        arena->_superblocks = 1;
+    }
+
+    _free_large(arena);
+    _use_superblock(arena, first, (uintptr_t) (arena + 1));
+}
+
+void mtmm_arena_destroy(mtmm_arena_t *arena)
+{
+    _free_large(arena);
+
+    /* the arena struct lives in its first superblock - not to be touched after this */
+    _return_superblocks(arena->_pFirst, arena->_pCurrent, arena->_superblocks);
+}
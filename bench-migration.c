@@ -0,0 +1,182 @@
+/*
+ *  bench-migration
+ *
+ *  Superblock migration between the private heaps and the global heap under a
+ *  bursty workload, with the fixed Hoard policy (HOARD_K, HOARD_EMPTY_FRACTION)
+ *  and with the adaptive one (see mtmm_set_adaptive_migration()).
+ *
+ *  Syntax:
+ *  bench-migration [ threads [ rounds [ burst ]]]
+ *
+ *  Every thread keeps a live set of small objects and, each round, allocates a
+ *  burst of <burst> more and frees them again - the pattern that makes a heap
+ *  donate superblocks on the frees and adopt them back on the next mallocs. Each
+ *  policy runs in a process of its own and reports the superblock migrations,
+ *  the bounces among them, the private heaps the threads ran on, the peak memory
+ *  mapped from core against the peak bytes live (the blowup) and the time taken.
+ *
+ *  Threads pick their heaps by a hash of their ids, which moves with address
+ *  space randomization, so two threads may share a heap on one run and not on the
+ *  next; a shared heap smooths one thread's bursts with the other's, and migrates
+ *  far less. Compare runs that report the same number of heaps.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "mtmm.h"
+#include "ptbarrier.h"
+
+#define USECSPERSEC 1000000
+#define MAX_THREADS 64
+#define LIVE_OBJECTS 2000
+#define MAX_BURST 20000
+
+typedef struct {
+    unsigned int _id;
+    void *_live[LIVE_OBJECTS];
+    void *_burst[MAX_BURST];
+} bench_thread_t;
+
+static unsigned int threadCount = 2, rounds = 500, burst = 5000;
+static pthread_barrier_t barrier;
+
+/* bytes live right now and at most, as asked for */
+static size_t liveBytes, peakLiveBytes;
+static unsigned long long peakCoreBytes;
+
+static size_t objectSize(unsigned long long *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return 16 + *seed % 241;
+}
+
+static void addLive(long long bytes)
+{
+    size_t now = __atomic_add_fetch(&liveBytes, bytes, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&peakLiveBytes, __ATOMIC_RELAXED);
+
+    while (now > peak && !__atomic_compare_exchange_n(&peakLiveBytes, &peak, now, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static void sampleCore(void)
+{
+    mtmm_stats_t stats;
+
+    mtmm_stats(&stats);
+    if (stats._coreBytesMapped > peakCoreBytes)
+        peakCoreBytes = stats._coreBytesMapped;
+}
+
+static void *run(void *arg)
+{
+    bench_thread_t *thread = arg;
+    unsigned long long seed = 88172645463325252ULL + thread->_id;
+    size_t size, total;
+    unsigned int i, round;
+
+    for (i = 0, total = 0; i < LIVE_OBJECTS; i++) {
+        size = objectSize(&seed);
+        thread->_live[i] = malloc(size);
+        total += size;
+    }
+    addLive(total);
+    pthread_barrier_wait(&barrier);
+
+    for (round = 0; round < rounds; round++) {
+        for (i = 0, total = 0; i < burst; i++) {
+            size = objectSize(&seed);
+            thread->_burst[i] = malloc(size);
+            total += size;
+        }
+        addLive(total);
+        if (thread->_id == 0 && round % 16 == 0)
+            sampleCore();
+        for (i = 0; i < burst; i++)
+            free(thread->_burst[i]);
+        addLive(-(long long) total);
+    }
+
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < LIVE_OBJECTS; i++)
+        free(thread->_live[i]);
+    return NULL;
+}
+
+static void runPolicy(int adaptive)
+{
+    static bench_thread_t threads[MAX_THREADS];
+    pthread_t pthreads[MAX_THREADS];
+    struct timeval start, end;
+    unsigned long long migrations = 0, bounces = 0;
+    mtmm_stats_t stats;
+    unsigned int i, heaps = 0;
+    double seconds;
+
+    mtmm_set_adaptive_migration(adaptive);
+    pthread_barrier_init(&barrier, NULL, threadCount + 1);
+    for (i = 0; i < threadCount; i++) {
+        threads[i]._id = i;
+        pthread_create(&pthreads[i], NULL, run, &threads[i]);
+    }
+
+    pthread_barrier_wait(&barrier);
+    gettimeofday(&start, NULL);
+    pthread_barrier_wait(&barrier);
+    gettimeofday(&end, NULL);
+    sampleCore();
+
+    mtmm_stats(&stats);
+    for (i = 0; i < NUMBER_OF_ALL_HEAPS; i++) {
+        migrations += stats._heaps[i]._counters._superblocksAdopted + stats._heaps[i]._counters._superblocksDonated;
+        bounces += stats._heaps[i]._counters._migrationBounces;
+        /* a thread's heap took its lock for each of its mallocs and frees, the main
+           thread's for a handful */
+        if (!IS_GLOBAL_HEAP_IX(i) && stats._heaps[i]._counters._lockAcquisitions >= (unsigned long long) rounds * burst)
+            heaps++;
+    }
+    for (i = 0; i < threadCount; i++)
+        pthread_join(pthreads[i], NULL);
+
+    seconds = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / (double) USECSPERSEC;
+    printf("%-8s migrations %10llu bounces %10llu heaps %2u peak core %7.1f MB peak live %7.1f MB blowup %5.2f time %7.3f s\n",
+            adaptive ? "adaptive" : "fixed", migrations, bounces, heaps, peakCoreBytes / 1048576.0,
+            peakLiveBytes / 1048576.0, (double) peakCoreBytes / peakLiveBytes, seconds);
+}
+
+int main(int argc, char *argv[])
+{
+    int adaptive, status;
+
+    if (argc > 1)
+        threadCount = atoi(argv[1]);
+    if (argc > 2)
+        rounds = atoi(argv[2]);
+    if (argc > 3)
+        burst = atoi(argv[3]);
+    if (threadCount < 1 || threadCount > MAX_THREADS || burst > MAX_BURST) {
+        printf("Syntax: %s [ threads (1-%d) [ rounds [ burst (up to %d) ]]]\n", argv[0], MAX_THREADS, MAX_BURST);
+        return 1;
+    }
+
+    printf("threads %u rounds %u burst %u\n", threadCount, rounds, burst);
+    fflush(stdout);
+    for (adaptive = 0; adaptive <= 1; adaptive++) {
+        /* a fresh process for each policy, so neither inherits the other's heaps */
+        if (fork() == 0) {
+            runPolicy(adaptive);
+            return 0;
+        }
+        wait(&status);
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ *  bench-pmr
+ *
+ *  Compares std::pmr containers on mtmm::heap_resource against
+ *  std::pmr::new_delete_resource(). bench-pmr is linked with libmtmm.a, so
+ *  there new_delete_resource() reaches the Hoard heaps through the C++ runtime's
+ *  operator new; bench-pmr-sys is built without the library and measures
+ *  new_delete_resource() on the system allocator.
+ *
+ *  Syntax:
+ *  bench-pmr [ repetitions [ elements ]]
+ *
+ *  Each workload runs over <elements> elements per repetition and reports the
+ *  mean, standard deviation and minimum ns per element over <repetitions>.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef MTMM_BENCH_SYSTEM
+#include "mtmm_pmr.h"
+#endif
+
+#define MAX_REPETITIONS 100
+
+static unsigned int repetitions = 10;
+static unsigned long elements = 100000;
+
+static double samples[MAX_REPETITIONS];
+
+/* keeps the compiler from dropping the workloads */
+static volatile std::size_t sink;
+
+static double nowNs()
+{
+    return std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void report(const char *workload, const char *resource)
+{
+    unsigned int i;
+    double sum = 0.0, stddev = 0.0, min = samples[0], average;
+
+    for (i = 0; i < repetitions; i++) {
+        sum += samples[i];
+        if (samples[i] < min)
+            min = samples[i];
+    }
+    average = sum / repetitions;
+    for (i = 0; i < repetitions; i++)
+        stddev += (samples[i] - average) * (samples[i] - average);
+    stddev = repetitions > 1 ? std::sqrt(stddev / (repetitions - 1)) : 0.0;
+
+    std::printf("%-24s %-14s %10.2f %10.2f %10.2f\n", workload, resource, average, stddev, min);
+}
+
+/* one vector grown element by element, reallocating as it doubles */
+static void benchVectorGrowth(std::pmr::memory_resource *resource, const char *name)
+{
+    for (unsigned int r = 0; r < repetitions; r++) {
+        double start = nowNs();
+        {
+            std::pmr::vector<long> v(resource);
+            for (unsigned long i = 0; i < elements; i++)
+                v.push_back(i);
+            sink += v.size();
+        }
+        samples[r] = (nowNs() - start) / elements;
+    }
+    report("vector push_back", name);
+}
+
+/* many short vectors of short strings, the small object churn of request handling */
+static void benchSmallVectors(std::pmr::memory_resource *resource, const char *name)
+{
+    for (unsigned int r = 0; r < repetitions; r++) {
+        double start = nowNs();
+        {
+            std::pmr::vector<std::pmr::vector<std::pmr::string>> outer(resource);
+            for (unsigned long i = 0; i < elements / 8; i++) {
+                outer.emplace_back();
+                for (unsigned int j = 0; j < 8; j++)
+                    outer.back().emplace_back("a string past the SSO buffer", 20 + j);
+            }
+            sink += outer.size();
+        }
+        samples[r] = (nowNs() - start) / elements;
+    }
+    report("vector<vector<string>>", name);
+}
+
+/* a map filled, probed and emptied: one node allocation and free per element */
+static void benchUnorderedMap(std::pmr::memory_resource *resource, const char *name)
+{
+    for (unsigned int r = 0; r < repetitions; r++) {
+        double start = nowNs();
+        {
+            std::pmr::unordered_map<unsigned long, unsigned long> map(resource);
+            for (unsigned long i = 0; i < elements; i++)
+                map.emplace(i * 2654435761UL, i);
+            for (unsigned long i = 0; i < elements; i++)
+                sink += map.count(i * 2654435761UL);
+            for (unsigned long i = 0; i < elements; i++)
+                map.erase(i * 2654435761UL);
+        }
+        samples[r] = (nowNs() - start) / elements;
+    }
+    report("unordered_map", name);
+}
+
+static void benchResource(std::pmr::memory_resource *resource, const char *name)
+{
+    benchVectorGrowth(resource, name);
+    benchSmallVectors(resource, name);
+    benchUnorderedMap(resource, name);
+}
+
+int main(int argc, char *argv[])
+{
+    switch (argc) {
+    case 3:
+        elements = std::strtoul(argv[2], NULL, 10);
+        if (elements < 8)
+            elements = 8;
+        /* fall through */
+    case 2:
+        repetitions = std::atoi(argv[1]);
+        if (repetitions > MAX_REPETITIONS)
+            repetitions = MAX_REPETITIONS;
+        if (repetitions == 0)
+            repetitions = 1;
+        /* fall through */
+    case 1:
+        break;
+    default:
+        std::printf("Unrecognized arguments.\n");
+        return 1;
+    }
+
+    std::printf("Repetitions: %u, Elements: %lu\n", repetitions, elements);
+    std::printf("%-24s %-14s %10s %10s %10s\n", "workload", "resource", "ns/elem", "stddev", "min");
+
+#ifndef MTMM_BENCH_SYSTEM
+    benchResource(mtmm::get_heap_resource(), "heap");
+#endif
+    benchResource(std::pmr::new_delete_resource(), "new_delete");
+
+    return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ *  bench-primitives
+ *
+ *  Micro-benchmarks for the internal allocator primitives. The primitives are
+ *  called directly on privately built superblocks and size classes, so no heap
+ *  lock is taken and the numbers are not hidden behind lock costs.
+ *
+ *  Syntax:
+ *  bench-primitives [ repetitions [ operations ]]
+ *
+ *  Each benchmark runs <operations> calls of the primitive per repetition and
+ *  reports the mean, standard deviation and minimum ns/op over <repetitions>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "memory_allocator.h"
+#include "size_class.h"
+
+#define MAX_REPETITIONS 100
+#define MAX_OPERATIONS 1000000
+#define MAX_LIST_LENGTH 512
+#define MAX_MADE_SUPERBLOCKS 256
+
+static unsigned int repetitions = 10;
+static unsigned long operations = 100000;
+
+/* per repetition ns/op samples of the currently running benchmark */
+static double samples[MAX_REPETITIONS];
+
+/* workload buffers, kept static so the benchmark does not allocate */
+static size_t sizes[MAX_OPERATIONS];
+static superblock_t *superblocks[MAX_LIST_LENGTH + 1];
+static superblock_t *made[MAX_MADE_SUPERBLOCKS];
+static cpuheap_t dummyHeap;
+
+/* keeps the compiler from dropping results of the timed calls */
+static volatile size_t sink;
+
+typedef enum {
+    FULLNESS_UNIFORM,
+    FULLNESS_ALL_FULL,
+    FULLNESS_ALL_EMPTY,
+    FULLNESS_FULL_BUT_LAST
+} fullness_distribution_t;
+
+static const char *fullnessNames[] = { "uniform", "all-full", "all-empty", "full-but-last" };
+
+typedef enum {
+    SIZES_SMALL,
+    SIZES_MIXED,
+    SIZES_POW2
+} size_mix_t;
+
+static const char *sizeMixNames[] = { "small", "mixed", "pow2" };
+
+static unsigned long long rngState = 88172645463325252ULL;
+
+static unsigned long long xorshift(void)
+{
+    rngState ^= rngState << 13;
+    rngState ^= rngState >> 7;
+    rngState ^= rngState << 17;
+    return rngState;
+}
+
+static double nowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char *name, const char *params)
+{
+    unsigned int i;
+    double sum = 0.0, stddev = 0.0, min = samples[0], average;
+
+    for (i = 0; i < repetitions; i++) {
+        sum += samples[i];
+        if (samples[i] < min)
+            min = samples[i];
+    }
+    average = sum / repetitions;
+    for (i = 0; i < repetitions; i++)
+        stddev += (samples[i] - average) * (samples[i] - average);
+    stddev = repetitions > 1 ? sqrt(stddev / (repetitions - 1)) : 0.0;
+
+    printf("%-26s %-32s %10.2f %10.2f %10.2f\n", name, params, average, stddev, min);
+}
+
+/* pop blocks until the superblock has the given fullness (0-100) */
+static void fillSuperblock(superblock_t *pSb, unsigned int percent)
+{
+    unsigned int target = (pSb->_meta._NoBlks * percent) / 100;
+
+    while (pSb->_meta._NoBlks - pSb->_meta._NoFreeBlks < target)
+        popBlock(pSb);
+}
+
+static unsigned int pickFullness(fullness_distribution_t dist, unsigned int i, unsigned int length)
+{
+    switch (dist) {
+    case FULLNESS_ALL_FULL:
+        return 100;
+    case FULLNESS_ALL_EMPTY:
+        return 0;
+    case FULLNESS_FULL_BUT_LAST:
+        return i == length - 1 ? 50 : 100;
+    case FULLNESS_UNIFORM:
+    default:
+        return xorshift() % 101;
+    }
+}
+
+/* build a size class list of the given length whose members follow dist */
+static void buildList(size_class_t *sizeClass, size_t sizeClassBytes, unsigned int length,
+                      fullness_distribution_t dist)
+{
+    unsigned int i;
+
+    memset(sizeClass, 0, sizeof(*sizeClass));
+    sizeClass->_sizeClassBytes = sizeClassBytes;
+
+    for (i = 0; i < length; i++) {
+        superblocks[i] = makeSuperblock(sizeClassBytes);
+        superblocks[i]->_meta._pOwnerHeap = &dummyHeap;
+        fillSuperblock(superblocks[i], pickFullness(dist, i, length));
+        insertSuperBlock(sizeClass, superblocks[i]);
+    }
+}
+
+static void destroyList(size_class_t *sizeClass, unsigned int length)
+{
+    unsigned int i;
+
+    for (i = 0; i < length; i++) {
+        removeSuperBlock(sizeClass, superblocks[i]);
+        freeCore(superblocks[i], superblocks[i]->_meta._size);
+    }
+}
+
+static void benchGetSizeClassIndex(size_mix_t mix)
+{
+    unsigned int r;
+    unsigned long i;
+    double start;
+
+    for (i = 0; i < operations; i++) {
+        switch (mix) {
+        case SIZES_SMALL:
+            sizes[i] = 1 + xorshift() % 64;
+            break;
+        case SIZES_MIXED:
+            sizes[i] = 1 + xorshift() % (1UL << (1 + xorshift() % 15));
+            break;
+        case SIZES_POW2:
+            sizes[i] = 1UL << (xorshift() % 16);
+            break;
+        }
+    }
+
+    for (r = 0; r < repetitions; r++) {
+        start = nowNs();
+        for (i = 0; i < operations; i++)
+            sink += getSizeClassIndex(sizes[i]);
+        samples[r] = (nowNs() - start) / operations;
+    }
+
+    report("getSizeClassIndex", sizeMixNames[mix]);
+}
+
+static void benchMakeSuperblock(size_t sizeClassBytes)
+{
+    unsigned int r, i;
+    unsigned int count = operations < MAX_MADE_SUPERBLOCKS ? operations : MAX_MADE_SUPERBLOCKS;
+    double start;
+    char params[64];
+
+    for (r = 0; r < repetitions; r++) {
+        start = nowNs();
+        for (i = 0; i < count; i++)
+            made[i] = makeSuperblock(sizeClassBytes);
+        samples[r] = (nowNs() - start) / count;
+
+        for (i = 0; i < count; i++)
+            freeCore(made[i], made[i]->_meta._size);
+    }
+
+    snprintf(params, sizeof(params), "class=%zu", sizeClassBytes);
+    report("makeSuperblock", params);
+}
+
+static void benchPopPush(size_t sizeClassBytes)
+{
+    superblock_t *pSb = makeSuperblock(sizeClassBytes);
+    block_header_t **blocks = (block_header_t **) getCore(pSb->_meta._NoBlks * sizeof(block_header_t *));
+    unsigned int r, i, n = pSb->_meta._NoBlks;
+    unsigned long done;
+    double popNs[MAX_REPETITIONS], start, popTime, pushTime;
+    char params[64];
+
+    for (r = 0; r < repetitions; r++) {
+        popTime = pushTime = 0.0;
+        for (done = 0; done < operations; done += n) {
+            start = nowNs();
+            for (i = 0; i < n; i++)
+                blocks[i] = popBlock(pSb);
+            popTime += nowNs() - start;
+
+            start = nowNs();
+            for (i = n; i > 0; i--)
+                pushBlock(pSb, blocks[i - 1]);
+            pushTime += nowNs() - start;
+        }
+        popNs[r] = popTime / done;
+        samples[r] = pushTime / done;
+    }
+
+    snprintf(params, sizeof(params), "class=%zu blocks=%u", sizeClassBytes, n);
+    report("pushBlock", params);
+    memcpy(samples, popNs, sizeof(popNs));
+    report("popBlock", params);
+
+    freeCore(blocks, n * sizeof(block_header_t *));
+    freeCore(pSb, pSb->_meta._size);
+}
+
+static void benchInsertSuperBlock(unsigned int length, fullness_distribution_t dist)
+{
+    size_class_t sizeClass;
+    superblock_t *probe;
+    unsigned int r;
+    unsigned long i;
+    double start;
+    char params[64];
+
+    buildList(&sizeClass, 64, length, dist);
+    probe = makeSuperblock(64);
+    probe->_meta._pOwnerHeap = &dummyHeap;
+    fillSuperblock(probe, 50);
+
+    for (r = 0; r < repetitions; r++) {
+        start = nowNs();
+        for (i = 0; i < operations; i++) {
+            insertSuperBlock(&sizeClass, probe);
+            removeSuperBlock(&sizeClass, probe);
+        }
+        samples[r] = (nowNs() - start) / operations;
+    }
+
+    snprintf(params, sizeof(params), "length=%u %s", length, fullnessNames[dist]);
+    report("insert+removeSuperBlock", params);
+
+    freeCore(probe, probe->_meta._size);
+    destroyList(&sizeClass, length);
+}
+
+static void benchFindAvailableSuperblock(unsigned int length, fullness_distribution_t dist)
+{
+    size_class_t sizeClass;
+    unsigned int r;
+    unsigned long i;
+    double start;
+    char params[64];
+
+    buildList(&sizeClass, 64, length, dist);
+
+    for (r = 0; r < repetitions; r++) {
+        start = nowNs();
+        for (i = 0; i < operations; i++)
+            sink += (size_t) findAvailableSuperblock(&sizeClass);
+        samples[r] = (nowNs() - start) / operations;
+    }
+
+    snprintf(params, sizeof(params), "length=%u %s", length, fullnessNames[dist]);
+    report("findAvailableSuperblock", params);
+
+    destroyList(&sizeClass, length);
+}
+
+/* a heap of length superblocks spread over all size class lists, as after a burst */
+static void benchFindMostlyEmptySuperblock(unsigned int length, fullness_distribution_t dist)
+{
+    static cpuheap_t heap;
+    unsigned int r, i;
+    unsigned long op;
+    double start;
+    char params[64];
+
+    memset(&heap, 0, sizeof(heap));
+    for (i = 0; i < length; i++) {
+        superblocks[i] = makeSuperblock(1UL << (i % NUMBER_OF_SIZE_CLASSES));
+        fillSuperblock(superblocks[i], pickFullness(dist, i, length));
+        addSuperblockToHeap(&heap, i % NUMBER_OF_SIZE_CLASSES, superblocks[i]);
+    }
+
+    for (r = 0; r < repetitions; r++) {
+        start = nowNs();
+        for (op = 0; op < operations; op++)
+            sink += (size_t) findMostlyEmptySuperblock(&heap);
+        samples[r] = (nowNs() - start) / operations;
+    }
+
+    snprintf(params, sizeof(params), "length=%u %s", length, fullnessNames[dist]);
+    report("findMostlyEmptySuperblock", params);
+
+    for (i = 0; i < length; i++) {
+        removeSuperblockFromHeap(&heap, i % NUMBER_OF_SIZE_CLASSES, superblocks[i]);
+        freeCore(superblocks[i], superblocks[i]->_meta._size);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    static const size_t classes[] = { 8, 64, 512, 4096, 32768 };
+    static const unsigned int lengths[] = { 1, 8, 64, 512 };
+    unsigned int i, j;
+
+    switch (argc) {
+    case 3:
+        operations = strtoul(argv[2], NULL, 10);
+        if (operations > MAX_OPERATIONS)
+            operations = MAX_OPERATIONS;
+        if (operations == 0)
+            operations = 1;
+    case 2:
+        repetitions = atoi(argv[1]);
+        if (repetitions > MAX_REPETITIONS)
+            repetitions = MAX_REPETITIONS;
+        if (repetitions == 0)
+            repetitions = 1;
+    case 1:
+        break;
+    default:
+        printf("Unrecognized arguments.\n");
+        return 1;
+    }
+
+    printf("Repetitions: %u, Operations: %lu\n", repetitions, operations);
+    printf("%-26s %-32s %10s %10s %10s\n", "primitive", "parameters", "ns/op", "stddev", "min");
+
+    for (i = SIZES_SMALL; i <= SIZES_POW2; i++)
+        benchGetSizeClassIndex(i);
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+        benchMakeSuperblock(classes[i]);
+
+    for (i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+        benchPopPush(classes[i]);
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+        for (j = FULLNESS_UNIFORM; j <= FULLNESS_FULL_BUT_LAST; j++)
+            benchInsertSuperBlock(lengths[i], j);
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+        for (j = FULLNESS_UNIFORM; j <= FULLNESS_FULL_BUT_LAST; j++)
+            benchFindAvailableSuperblock(lengths[i], j);
+
+    for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+        for (j = FULLNESS_UNIFORM; j <= FULLNESS_FULL_BUT_LAST; j++)
+            benchFindMostlyEmptySuperblock(lengths[i], j);
+
+    return 0;
+}
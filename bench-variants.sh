@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+#  bench-variants.sh
+#
+#  Runs the scalability workloads against the default library and against each
+#  variant named on the command line (see VARIANTS in the Makefile), and prints
+#  a table of their average times in seconds, followed by the superblock
+#  migrations and blowup bench-migration reports for the adaptive policy.
+#
+#  Syntax:
+#  bench-variants.sh [ variant ... ]
+#
+#  Expects linux-scalability, bench-migration and their -<variant> builds in the
+#  current directory, as make bench-variants leaves them.
+#
+
+# linux-scalability size iterations threads
+WORKLOADS="16:1000000:1 64:1000000:1 64:1000000:4 1024:500000:4 8192:100000:4"
+# bench-migration threads rounds burst
+MIGRATION="2 300 1500"
+
+suffix()
+{
+    [ "$1" = default ] || echo "-$1"
+}
+
+printf "%-12s" variant
+for workload in $WORKLOADS; do
+    printf " %14s" "$workload"
+done
+printf " %10s %7s\n" migrations blowup
+
+for variant in default "$@"; do
+    printf "%-12s" "$variant"
+    for workload in $WORKLOADS; do
+        seconds=$(./linux-scalability$(suffix "$variant") $(echo "$workload" | tr : ' ') |
+                sed -n 's/^Average execution time = \([0-9.]*\) .*/\1/p')
+        printf " %14s" "${seconds:-failed}"
+    done
+    ./bench-migration$(suffix "$variant") $MIGRATION |
+            awk '/^adaptive/ { printf " %10s %7s\n", $3, $(NF - 3); found = 1 } END { if (!found) print " failed" }'
+done
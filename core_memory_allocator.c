@@ -7,16 +7,34 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "memory_allocator.h"
+#include "stats.h"
+#include "probes.h"
+
 
 #define MAPFILE "/dev/zero"
 
+#define PAGE_CEIL(x) (((x) + getpagesize() - 1) & ~((size_t) getpagesize() - 1))
+
 
 
+static void *mapCore(size_t size, int flags);
+
 void *getCore(size_t size) {
+    return mapCore(size, 0);
+}
+
+/* same as getCore, with every page faulted in up front */
+void *getPopulatedCore(size_t size) {
+    return mapCore(size, MAP_POPULATE);
+}
+
+static void *mapCore(size_t size, int flags) {
     int fd;
 
     fd = open(MAPFILE, O_RDWR);
@@ -26,18 +44,58 @@ void *getCore(size_t size) {
         exit(-1);
     }
 
-    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | flags, fd, 0);
+    STATS_ADD(_mmapCalls, 1);
     if (p == MAP_FAILED) {
         /* Q: Why isn't the fd closed here? Seems wrong */
         perror("Error mmapping the file");
         return NULL;
     }
     close(fd);
+    /* counted in whole pages, as munmap of any part of the mapping is */
+    STATS_ADD(_coreBytesMapped, PAGE_CEIL(size));
+    MTMM_PROBE2(core_map, p, size);
     return p;
 }
 
+/*
+ * size bytes aligned to alignment (a power of two multiple of the page size), to
+ * be backed by huge pages of that size. With hugetlb, explicit huge pages are tried
+ * first; otherwise, or when none are reserved, transparent huge pages are asked for.
+ */
+void *getHugeCore(size_t size, size_t alignment, bool hugetlb) {
+    uintptr_t start, aligned;
+    void *p;
+
+    if (hugetlb) {
+        p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        STATS_ADD(_mmapCalls, 1);
+        if (p != MAP_FAILED) {
+            STATS_ADD(_coreBytesMapped, size);
+            MTMM_PROBE2(core_map, p, size);
+            return p;
+        }
+    }
+
+    /* map enough to find an aligned start in, then give back what is around it */
+    start = (uintptr_t) mapCore(size + alignment, 0);
+    if (!start)
+        return NULL;
+    aligned = (start + alignment - 1) & ~((uintptr_t) alignment - 1);
+    if (aligned > start)
+        freeCore((void*) start, aligned - start);
+    if (start + alignment > aligned)
+        freeCore((void*) (aligned + size), start + alignment - aligned);
+
+    madvise((void*) aligned, size, MADV_HUGEPAGE);
+    return (void*) aligned;
+}
+
 void freeCore(void *p, size_t length){
 
+    STATS_ADD(_munmapCalls, 1);
+    STATS_SUB(_coreBytesMapped, PAGE_CEIL(length));
+    MTMM_PROBE2(core_unmap, p, length);
     if (munmap(p, length) == -1) {
 
         perror("Error freeing mapped  memory");
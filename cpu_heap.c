@@ -10,6 +10,15 @@
 #include "assert_static.h"
 
 static size_class_t * _get_superblock_size_class(cpuheap_t *heap, superblock_t *superblock);
+static void _link_by_fullness(cpuheap_t *heap, superblock_t *pSb);
+static void _unlink_by_fullness(cpuheap_t *heap, superblock_t *pSb);
+static void _update_fullness(cpuheap_t *heap, superblock_t *pSb);
+
+/* Hoard's K and f, lowered while the allocator is over its soft limit */
+size_t hoardK = HOARD_K;
+double hoardEmptyFraction = HOARD_EMPTY_FRACTION;
+/* the most bytes of slack a heap's adaptive K and f may use, 0 to use the fixed ones */
+size_t hoardMaxSlack = HOARD_MAX_SLACK;
 
 /* remove a superblock from a given heap and sizeclass index and update heap level stats */
 void removeSuperblockFromHeap(cpuheap_t *heap, int sizeClass_ix, superblock_t *pSb){
@@ -19,15 +28,15 @@ void removeSuperblockFromHeap(cpuheap_t *heap, int sizeClass_ix, superblock_t *p
     size_t superblock_bytes_used = getBytesUsed(pSb);
 
     assert(sizeClass_ix >= 0);
-    assert(sizeClass_ix < NUMBER_OF_SIZE_CLASSES);
+    assert(sizeClass_ix < NUMBER_OF_SIZE_CLASS_LISTS);
     assert(pSb->_meta._pOwnerHeap == heap);
-    assert(heap->_bytesAvailable >= SUPERBLOCK_SIZE);
+    assert(heap->_bytesAvailable >= pSb->_meta._size);
     assert(heap->_bytesUsed >= superblock_bytes_used);    
     removeSuperBlock(size_class, pSb);
+    _unlink_by_fullness(heap, pSb);
     pSb->_meta._pOwnerHeap = NULL;
 
-     /* TODO: Should this be replaced with something more accurate? */
-    heap->_bytesAvailable -= SUPERBLOCK_SIZE;
+    heap->_bytesAvailable -= pSb->_meta._size;
     heap->_bytesUsed -= superblock_bytes_used;
 }
 
@@ -38,10 +47,10 @@ void addSuperblockToHeap(cpuheap_t *heap, int sizeClass_ix, superblock_t *pSb){
     size_class_t *size_class = &(heap->_sizeClasses[sizeClass_ix]);
 
     insertSuperBlock(size_class, pSb);
+    _link_by_fullness(heap, pSb);
     pSb->_meta._pOwnerHeap = heap;
 
-     /* TODO: Should this be replaced with something more accurate? */
-    heap->_bytesAvailable += SUPERBLOCK_SIZE;
+    heap->_bytesAvailable += pSb->_meta._size;
     heap->_bytesUsed += getBytesUsed(pSb);
 }
 
@@ -62,6 +71,7 @@ void *allocateBlockFromCurrentHeap(superblock_t *pSb) {
     assert(heap->_bytesUsed >= old_bytes_used);
     heap->_bytesUsed -= old_bytes_used;
     heap->_bytesUsed += new_bytes_used;
+    _update_fullness(heap, pSb);
 
     if (block != NULL) {
         return ((void *) block) + sizeof(block_header_t);
@@ -82,6 +92,7 @@ void freeBlockFromCurrentHeap(block_header_t *pBlock) {
     assert(NULL != heap);
     size_class = _get_superblock_size_class(heap, superblock);
 
+    superblock->_meta._bytesRequested -= pBlock->size;
     old_bytes_used = getBytesUsed(superblock);
     freeBlockFromCurrentSizeClass(size_class, superblock, pBlock);
     new_bytes_used = getBytesUsed(superblock);
@@ -89,57 +100,141 @@ void freeBlockFromCurrentHeap(block_header_t *pBlock) {
     assert(heap->_bytesUsed >= old_bytes_used);
     heap->_bytesUsed -= old_bytes_used;
     heap->_bytesUsed += new_bytes_used;
+    _update_fullness(heap, superblock);
+}
+
+/* pop up to n blocks from a superblock of its owner heap into ptrs, returns how many */
+size_t allocateBlocksFromCurrentHeap(superblock_t *pSb, void **ptrs, size_t n) {
+    cpuheap_t *heap = pSb->_meta._pOwnerHeap;
+    size_t old_bytes_used = 0;
+    size_t count = 0;
+
+    assert(NULL != heap);
+
+    old_bytes_used = getBytesUsed(pSb);
+    count = allocateBlocksFromSizeClass(_get_superblock_size_class(heap, pSb), pSb, ptrs, n);
+
+    assert(heap->_bytesUsed >= old_bytes_used);
+    heap->_bytesUsed -= old_bytes_used;
+    heap->_bytesUsed += getBytesUsed(pSb);
+    _update_fullness(heap, pSb);
+
+    return count;
+}
+
+/* free n blocks that all belong to the same superblock back to its owner heap */
+void freeBlocksFromCurrentHeap(superblock_t *pSb, void **ptrs, size_t n) {
+    cpuheap_t *heap = pSb->_meta._pOwnerHeap;
+    size_t old_bytes_used = 0;
+    size_t i;
+
+    assert(NULL != heap);
+
+    for (i = 0; i < n; i++)
+        pSb->_meta._bytesRequested -= getBlockHeaderForPtr(ptrs[i])->size;
+
+    old_bytes_used = getBytesUsed(pSb);
+    freeBlocksFromCurrentSizeClass(_get_superblock_size_class(heap, pSb), pSb, ptrs, n);
+
+    assert(heap->_bytesUsed >= old_bytes_used);
+    heap->_bytesUsed -= old_bytes_used;
+    heap->_bytesUsed += getBytesUsed(pSb);
+    _update_fullness(heap, pSb);
 }
 
 /* this is a boolean function to check the condition
- * to transfer superblocks to general heap
+ * to transfer superblocks to general heap. K counts SUPERBLOCK_SIZE bytes, whatever
+ * the size of the heap's superblocks, so the reserve does not shrink when the
+ * emptiest one is of a small class.
  */
 bool isHeapUnderUtilized(cpuheap_t *pHeap) {
-    assert(pHeap->_bytesAvailable >= (HOARD_K * SUPERBLOCK_SIZE));
-    return ((double) pHeap->_bytesUsed < ((double) pHeap->_bytesAvailable) * (1 - HOARD_EMPTY_FRACTION)) &&
-        (pHeap->_bytesUsed < pHeap->_bytesAvailable - (HOARD_K * SUPERBLOCK_SIZE));
+    size_t maxSlack = __atomic_load_n(&hoardMaxSlack, __ATOMIC_RELAXED);
+    size_t slack = pHeap->_slack < maxSlack ? pHeap->_slack : maxSlack;
+    double f = hoardEmptyFraction + (double) slack / SUPERBLOCK_SIZE * HOARD_F_STEP;
+    size_t reserve = hoardK * SUPERBLOCK_SIZE + slack;
+
+    return ((double) pHeap->_bytesUsed < ((double) pHeap->_bytesAvailable) * (1 - f)) &&
+        (pHeap->_bytesAvailable > reserve) &&
+        (pHeap->_bytesUsed < pHeap->_bytesAvailable - reserve);
 }
 
 
 
+/*
+ * the emptiest superblock of the heap, to within a sixty-fourth of its blocks, or
+ * NULL if it has none: the first of the lowest fullness bucket in use
+ */
 superblock_t *findMostlyEmptySuperblock(cpuheap_t *pHeap){
     /* Assuming the heap is locked */
-    /* TODO: If size class locks are used, probably all of the size classes' locks
-             should be locked prior to calling to this function (otherwise
-             race conditions may occur)
-     */
-    size_class_t *current_size_class = NULL;
-    superblock_t *current_superblock = NULL;
-    superblock_t *min_superblock = NULL;
-    unsigned int i = 0;
-    double min_fullness = 2.0; /* More than 1 so that in the worst case a full superblock can be returned */
-    double current_fullnesss = 0;
-
-    for (i = 0; i < NUMBER_OF_SIZE_CLASSES; i++) {
-        current_size_class = &(pHeap->_sizeClasses[i]);
-        current_superblock = findMostlyEmptySuperblockSizeClass(current_size_class);
-
-        if (NULL != current_superblock) {
-            current_fullnesss = getFullness(current_superblock);
-            if (min_fullness > current_fullnesss) {
-                min_superblock = current_superblock;
-                min_fullness = current_fullnesss;
-            }
-        }
-    }
+    if (!pHeap->_fullnessMask)
+        return NULL;
 
-    return min_superblock;
+    return pHeap->_byFullness[__builtin_ctzll(pHeap->_fullnessMask)];
 }
 
 static size_class_t * _get_superblock_size_class(cpuheap_t *heap, superblock_t *superblock)
 {
-    size_t size_class_index = NUMBER_OF_SIZE_CLASSES;
+    size_t size_class_index = NUMBER_OF_SIZE_CLASS_LISTS;
 
     assert(heap != NULL);
     assert(superblock != NULL);
     assert(heap == superblock->_meta._pOwnerHeap);
 
-    size_class_index = getSizeClassIndex(superblock->_meta._sizeClassBytes);
+    size_class_index = getAlignedSizeClassIndex(superblock->_meta._sizeClassBytes,
+                                                superblock->_meta._alignment);
 
     return &(heap->_sizeClasses[size_class_index]);
 }
+
+/* the fullness bucket for used blocks of a superblock: empty is 0, full is the last */
+static unsigned int _fullness_bucket(const superblock_t *pSb, unsigned int used)
+{
+    return used * FULLNESS_BUCKETS / (pSb->_meta._NoBlks + 1);
+}
+
+/* put a superblock in the bucket of its fullness, remembering when it must move */
+static void _link_by_fullness(cpuheap_t *heap, superblock_t *pSb)
+{
+    unsigned int spread = pSb->_meta._NoBlks + 1;
+    unsigned int bucket = _fullness_bucket(pSb, pSb->_meta._NoBlks - pSb->_meta._NoFreeBlks);
+    superblock_t *next = heap->_byFullness[bucket];
+
+    /* the least used counts of this bucket and the next */
+    pSb->_meta._fullnessBucket = bucket;
+    pSb->_meta._bucketFloor = (bucket * spread + FULLNESS_BUCKETS - 1) / FULLNESS_BUCKETS;
+    pSb->_meta._bucketCeiling = ((bucket + 1) * spread + FULLNESS_BUCKETS - 1) / FULLNESS_BUCKETS;
+
+    pSb->_meta._pPrvByFullness = NULL;
+    pSb->_meta._pNxtByFullness = next;
+    if (next)
+        next->_meta._pPrvByFullness = pSb;
+    heap->_byFullness[bucket] = pSb;
+    heap->_fullnessMask |= 1ULL << bucket;
+}
+
+static void _unlink_by_fullness(cpuheap_t *heap, superblock_t *pSb)
+{
+    unsigned int bucket = pSb->_meta._fullnessBucket;
+    superblock_t *prev = pSb->_meta._pPrvByFullness, *next = pSb->_meta._pNxtByFullness;
+
+    if (prev)
+        prev->_meta._pNxtByFullness = next;
+    else
+        heap->_byFullness[bucket] = next;
+    if (next)
+        next->_meta._pPrvByFullness = prev;
+
+    if (!heap->_byFullness[bucket])
+        heap->_fullnessMask &= ~(1ULL << bucket);
+}
+
+/* after blocks of a superblock were taken or given back, two compares unless it changes bucket */
+static void _update_fullness(cpuheap_t *heap, superblock_t *pSb)
+{
+    unsigned int used = pSb->_meta._NoBlks - pSb->_meta._NoFreeBlks;
+
+    if (used < pSb->_meta._bucketFloor || used >= pSb->_meta._bucketCeiling) {
+        _unlink_by_fullness(heap, pSb);
+        _link_by_fullness(heap, pSb);
+    }
+}
@@ -0,0 +1,330 @@
+/*
+ *
+ *      This module implements the sampling heap profiler. Sample records live in
+ *      memory taken directly from core, never in the heaps being profiled, and are
+ *      linked into a list of live samples that is dumped in the pprof legacy heap
+ *      format ("heap_v2") on demand or on a signal.
+ */
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory_allocator.h"
+#include "heap_profile.h"
+#include "assert_static.h"
+
+#ifdef MTMM_HEAP_PROFILE
+
+/* records are carved from chunks of this size taken from core */
+#define SAMPLE_CHUNK_SIZE 65536
+
+/* frames of the profiler and the malloc wrapper left out of the stack */
+#define SKIPPED_FRAMES 2
+
+typedef struct sample {
+    struct sample *_pNext, *_pPrev;
+    void *_ptr;
+    size_t _size;
+    int _depth;
+    void *_stack[HEAP_PROFILE_MAX_DEPTH];
+} sample_t;
+
+__thread long long heapProfileBytesUntilSample;
+
+static __thread unsigned long long threadRngState;
+static __thread bool inProfiler;
+
+static pthread_mutex_t profileLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t profileOnce = PTHREAD_ONCE_INIT;
+static size_t sampleRate = HEAP_PROFILE_DEFAULT_RATE;
+
+/* circular list of live samples, headed by a sentinel, and free records */
+static sample_t liveSamples = { &liveSamples, &liveSamples };
+static sample_t *freeSamples;
+static unsigned long long liveCount, liveBytes, totalCount, totalBytes;
+
+static char signalDumpPath[256];
+
+static void _profile_init(void)
+{
+    const char *rate = getenv("MTMM_HEAP_PROFILE_RATE");
+
+    if (rate != NULL) {
+        sampleRate = strtoull(rate, NULL, 10);
+    }
+}
+
+static unsigned long long _next_random(void)
+{
+    /* xorshift64* */
+    threadRngState ^= threadRngState >> 12;
+    threadRngState ^= threadRngState << 25;
+    threadRngState ^= threadRngState >> 27;
+    return threadRngState * 2685821657736338717ULL;
+}
+
+/* exponentially distributed interval, so samples form a Poisson process over bytes */
+static long long _next_interval(void)
+{
+    size_t rate = __atomic_load_n(&sampleRate, __ATOMIC_RELAXED);
+    double u;
+
+    if (rate == 0) {
+        return INT64_MAX;
+    }
+
+    u = ((_next_random() >> 11) + 1) / 9007199254740992.0;
+    return (long long) (-log(u) * rate) + 1;
+}
+
+static sample_t *_new_sample(void)
+{
+    sample_t *sample = NULL;
+    unsigned int i;
+
+    if (freeSamples == NULL) {
+        sample = getCore(SAMPLE_CHUNK_SIZE);
+        if (sample == NULL) {
+            return NULL;
+        }
+        for (i = 0; i < SAMPLE_CHUNK_SIZE / sizeof(sample_t); i++) {
+            sample[i]._pNext = freeSamples;
+            freeSamples = &sample[i];
+        }
+    }
+
+    sample = freeSamples;
+    freeSamples = sample->_pNext;
+    return sample;
+}
+
+void heapProfileSample(void *ptr, size_t size)
+{
+    void *stack[HEAP_PROFILE_MAX_DEPTH + SKIPPED_FRAMES];
+    sample_t *sample = NULL;
+    struct timespec now;
+    int depth;
+
+    if (threadRngState == 0) {
+        /* first crossing in this thread - seed it, the interval so far was 0 */
+        pthread_once(&profileOnce, _profile_init);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        threadRngState = ((uintptr_t) &threadRngState * 0x9E3779B97F4A7C15ULL) ^
+                         ((unsigned long long) now.tv_sec << 32) ^ now.tv_nsec ^ 1;
+        heapProfileBytesUntilSample = _next_interval();
+        return;
+    }
+
+    heapProfileBytesUntilSample = _next_interval();
+
+    /* backtrace() may allocate the first time it runs */
+    if (inProfiler || __atomic_load_n(&sampleRate, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    inProfiler = true;
+
+    depth = backtrace(stack, HEAP_PROFILE_MAX_DEPTH + SKIPPED_FRAMES) - SKIPPED_FRAMES;
+
+    assert(pthread_mutex_lock(&profileLock) == 0);
+    sample = _new_sample();
+    if (sample != NULL) {
+        sample->_ptr = ptr;
+        sample->_size = size;
+        sample->_depth = depth > 0 ? depth : 0;
+        memcpy(sample->_stack, stack + SKIPPED_FRAMES, sample->_depth * sizeof(void *));
+
+        sample->_pNext = liveSamples._pNext;
+        sample->_pPrev = &liveSamples;
+        liveSamples._pNext->_pPrev = sample;
+        liveSamples._pNext = sample;
+
+        liveCount++;
+        liveBytes += size;
+        totalCount++;
+        totalBytes += size;
+
+        getBlockHeaderForPtr(ptr)->_pNextBlk = (block_header_t *) sample;
+    }
+    assert(pthread_mutex_unlock(&profileLock) == 0);
+
+    inProfiler = false;
+}
+
+void heapProfileRelease(block_header_t *pBlock)
+{
+    sample_t *sample = (sample_t *) pBlock->_pNextBlk;
+
+    pBlock->_pNextBlk = NULL;
+
+    assert(pthread_mutex_lock(&profileLock) == 0);
+    sample->_pPrev->_pNext = sample->_pNext;
+    sample->_pNext->_pPrev = sample->_pPrev;
+    liveCount--;
+    liveBytes -= sample->_size;
+
+    sample->_pNext = freeSamples;
+    freeSamples = sample;
+    assert(pthread_mutex_unlock(&profileLock) == 0);
+}
+
+/* buffered writer on the stack, so dumping never allocates */
+typedef struct {
+    int _fd;
+    size_t _length;
+    bool _failed;
+    char _buffer[4096];
+} dump_writer_t;
+
+static void _flush(dump_writer_t *writer)
+{
+    size_t offset = 0;
+    ssize_t written;
+
+    while (offset < writer->_length && !writer->_failed) {
+        written = write(writer->_fd, writer->_buffer + offset, writer->_length - offset);
+        if (written <= 0) {
+            writer->_failed = true;
+        } else {
+            offset += written;
+        }
+    }
+    writer->_length = 0;
+}
+
+static void _print(dump_writer_t *writer, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void _print(dump_writer_t *writer, const char *format, ...)
+{
+    va_list args;
+    int n;
+
+    /* lines are short, make sure one always fits */
+    if (writer->_length > sizeof(writer->_buffer) - 128) {
+        _flush(writer);
+    }
+
+    va_start(args, format);
+    n = vsnprintf(writer->_buffer + writer->_length, sizeof(writer->_buffer) - writer->_length, format, args);
+    va_end(args);
+
+    if (n > 0) {
+        writer->_length += (size_t) n < sizeof(writer->_buffer) - writer->_length ?
+            (size_t) n : sizeof(writer->_buffer) - writer->_length - 1;
+    }
+}
+
+static int _dump(int fd, bool fromSignal)
+{
+    dump_writer_t writer;
+    sample_t *sample = NULL;
+    ssize_t n;
+    int maps, i;
+
+    writer._fd = fd;
+    writer._length = 0;
+    writer._failed = false;
+
+    if (fromSignal) {
+        /* the interrupted code may hold the lock */
+        if (pthread_mutex_trylock(&profileLock) != 0) {
+            return -1;
+        }
+    } else {
+        assert(pthread_mutex_lock(&profileLock) == 0);
+    }
+
+    _print(&writer, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%zu\n",
+           liveCount, liveBytes, totalCount, totalBytes, sampleRate);
+
+    for (sample = liveSamples._pNext; sample != &liveSamples; sample = sample->_pNext) {
+        _print(&writer, "1: %zu [1: %zu] @", sample->_size, sample->_size);
+        for (i = 0; i < sample->_depth; i++) {
+            _print(&writer, " %p", sample->_stack[i]);
+        }
+        _print(&writer, "\n");
+    }
+
+    assert(pthread_mutex_unlock(&profileLock) == 0);
+
+    /* pprof needs the mappings to symbolize the stacks */
+    _print(&writer, "\nMAPPED_LIBRARIES:\n");
+    _flush(&writer);
+
+    maps = open("/proc/self/maps", O_RDONLY);
+    if (maps != -1) {
+        while ((n = read(maps, writer._buffer, sizeof(writer._buffer))) > 0) {
+            writer._length = n;
+            _flush(&writer);
+        }
+        close(maps);
+    }
+
+    return writer._failed ? -1 : 0;
+}
+
+static void _signal_handler(int signum)
+{
+    int saved_errno = errno;
+    int fd = open(signalDumpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (fd != -1) {
+        _dump(fd, true);
+        close(fd);
+    }
+    errno = saved_errno;
+}
+
+#endif /* MTMM_HEAP_PROFILE */
+
+void mtmm_heap_profile_set_rate(size_t bytes)
+{
+#ifdef MTMM_HEAP_PROFILE
+    pthread_once(&profileOnce, _profile_init);
+    __atomic_store_n(&sampleRate, bytes, __ATOMIC_RELAXED);
+#endif
+}
+
+int mtmm_heap_profile_dump(int fd)
+{
+#ifdef MTMM_HEAP_PROFILE
+    return _dump(fd, false);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int mtmm_heap_profile_dump_on_signal(int signum, const char *path)
+{
+#ifdef MTMM_HEAP_PROFILE
+    struct sigaction action;
+
+    if (strlen(path) >= sizeof(signalDumpPath)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(signalDumpPath, path);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = _signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    return sigaction(signum, &action, NULL);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
@@ -0,0 +1,59 @@
+/*
+ * heap_profile.h
+ *
+ *      Sampling heap profiler hooks, active when the library is built with
+ *      MTMM_HEAP_PROFILE. Each thread counts down the bytes it allocates and
+ *      samples the allocation that crosses a randomly drawn interval, so the
+ *      hot path costs a subtraction and a branch.
+ *
+ *      A sampled block keeps its sample record in the free list link of its
+ *      header, which is otherwise NULL while the block is live.
+ */
+
+#ifndef __HEAP_PROFILE_H__
+#define __HEAP_PROFILE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mtmm.h"
+
+/* mean number of bytes between samples */
+#define HEAP_PROFILE_DEFAULT_RATE (512 * 1024)
+
+/* deepest stack kept for a sample */
+#define HEAP_PROFILE_MAX_DEPTH 32
+
+#ifdef MTMM_HEAP_PROFILE
+
+extern __thread long long heapProfileBytesUntilSample;
+
+void heapProfileSample(void *ptr, size_t size);
+void heapProfileRelease(block_header_t *pBlock);
+
+/* blocks in a shared memory segment are never sampled, another process may free them */
+bool shmContains(const void *p);
+
+#define HEAP_PROFILE_ALLOC(ptr, size)                                           \
+    do {                                                                        \
+        if ((heapProfileBytesUntilSample -= (size)) < 0 && (ptr) != NULL &&     \
+                !shmContains(ptr)) {                                            \
+            heapProfileSample((ptr), (size));                                   \
+        }                                                                       \
+    } while (0)
+
+#define HEAP_PROFILE_FREE(pBlock)                                               \
+    do {                                                                        \
+        if ((pBlock)->_pNextBlk != NULL && !shmContains(pBlock)) {              \
+            heapProfileRelease(pBlock);                                         \
+        }                                                                       \
+    } while (0)
+
+#else /* Not MTMM_HEAP_PROFILE */
+
+#define HEAP_PROFILE_ALLOC(ptr, size)
+#define HEAP_PROFILE_FREE(pBlock)
+
+#endif /* MTMM_HEAP_PROFILE */
+
+#endif /* __HEAP_PROFILE_H__ */
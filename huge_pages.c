@@ -0,0 +1,193 @@
+/*
+ *
+ *      This module packs superblocks into huge page sized regions, so the
+ *      superblocks of a heap share TLB entries instead of each spreading over
+ *      4KB pages of its own. Superblocks made for the same heap are carved from
+ *      the same region whatever their size class and size, so a heap that uses
+ *      a few classes does not hold a mostly empty huge page for each. A region goes
+ *      back to the OS only once none of its superblocks is in use, so its huge
+ *      page is never split.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory_allocator.h"
+
+#define REGION_SIZE (2UL << 20)
+
+/* superblock sizes are powers of two from SUPERBLOCK_MIN_SIZE to SUPERBLOCK_MAX_SIZE */
+#define SLOT_ORDERS (__builtin_ctz(SUPERBLOCK_MAX_SIZE / SUPERBLOCK_MIN_SIZE) + 1)
+#define SLOT_ORDER(size) __builtin_ctzl((size) / SUPERBLOCK_MIN_SIZE)
+
+typedef struct hugepage_region {
+    /* the list of regions of the same heap with room left */
+    struct hugepage_region *_next, *_prev;
+
+    /* superblocks handed out and not given back, and where bytes never handed out yet start */
+    unsigned int _live, _nextByte;
+
+    /* slots given back, by order of their size, chained through their _pNxtSBlk */
+    superblock_t *_freeSlots[SLOT_ORDERS];
+
+    /* the heap the region was made for */
+    unsigned int _heapIndex;
+} hugepage_region_t;
+
+/* slots are cache line aligned and follow the region's header */
+#define SLOT_ALIGN 64
+#define FIRST_SLOT ((sizeof(hugepage_region_t) + SLOT_ALIGN - 1) & ~(size_t) (SLOT_ALIGN - 1))
+
+#define REGION_OF(pSb) ((hugepage_region_t*) ((uintptr_t) (pSb) & ~(REGION_SIZE - 1)))
+
+static int hugePageMode = MTMM_HUGE_PAGES_OFF;
+
+/* taken only to make or give back a superblock, innermost of all locks */
+static pthread_mutex_t regionLock = PTHREAD_MUTEX_INITIALIZER;
+static hugepage_region_t *partialRegions[NUMBER_OF_ALL_HEAPS];
+
+
+bool hugePagesEnabled(void)
+{
+    return __atomic_load_n(&hugePageMode, __ATOMIC_RELAXED) != MTMM_HUGE_PAGES_OFF;
+}
+
+static void linkRegion(hugepage_region_t *region)
+{
+    hugepage_region_t **head = &partialRegions[region->_heapIndex];
+
+    region->_prev = NULL;
+    region->_next = *head;
+    if (*head)
+        (*head)->_prev = region;
+    *head = region;
+}
+
+static void unlinkRegion(hugepage_region_t *region)
+{
+    if (region->_prev)
+        region->_prev->_next = region->_next;
+    else
+        partialRegions[region->_heapIndex] = region->_next;
+    if (region->_next)
+        region->_next->_prev = region->_prev;
+}
+
+/* true if a superblock of size bytes can be carved from region */
+static bool regionFits(const hugepage_region_t *region, size_t size)
+{
+    return region->_freeSlots[SLOT_ORDER(size)] || REGION_SIZE - region->_nextByte >= size;
+}
+
+/* full when not even a superblock of the smallest size fits */
+static bool isRegionFull(const hugepage_region_t *region)
+{
+    int order;
+
+    for (order = 0; order < SLOT_ORDERS; order++) {
+        if (region->_freeSlots[order])
+            return false;
+    }
+    return REGION_SIZE - region->_nextByte < SUPERBLOCK_MIN_SIZE;
+}
+
+/*
+ * size bytes for a superblock of heap i, from a region of the heap with room for
+ * them or from a new one placed on node. The memory is not formatted. A new
+ * region's huge page is faulted in as its header is written. A slot given back
+ * is only reused for a superblock of the same size.
+ */
+superblock_t *getRegionSuperblock(int heapIndex, unsigned int node, size_t size)
+{
+    hugepage_region_t *region;
+    superblock_t *pSb;
+    int order = SLOT_ORDER(size);
+
+    pthread_mutex_lock(&regionLock);
+    for (region = partialRegions[heapIndex]; region && !regionFits(region, size); region = region->_next)
+        ;
+    if (!region) {
+        pthread_mutex_unlock(&regionLock);
+
+        region = getHugeCore(REGION_SIZE, REGION_SIZE,
+                __atomic_load_n(&hugePageMode, __ATOMIC_RELAXED) == MTMM_HUGE_PAGES_HUGETLB);
+        if (!region)
+            return NULL;
+        if (numaNodeCount() > 1)
+            numaBind(region, REGION_SIZE, node);
+
+        region->_live = 0;
+        region->_nextByte = FIRST_SLOT;
+        memset(region->_freeSlots, 0, sizeof(region->_freeSlots));
+        region->_heapIndex = heapIndex;
+
+        pthread_mutex_lock(&regionLock);
+        linkRegion(region);
+    }
+
+    if (region->_freeSlots[order]) {
+        pSb = region->_freeSlots[order];
+        region->_freeSlots[order] = pSb->_meta._pNxtSBlk;
+    } else {
+        pSb = (superblock_t*) ((char*) region + region->_nextByte);
+        region->_nextByte += size;
+    }
+    region->_live++;
+    if (isRegionFull(region))
+        unlinkRegion(region);
+    pthread_mutex_unlock(&regionLock);
+
+    return pSb;
+}
+
+/* give back the slot of a superblock from getRegionSuperblock(), unmapping its region once empty */
+void putRegionSuperblock(superblock_t *pSb)
+{
+    hugepage_region_t *region = REGION_OF(pSb);
+    int order = SLOT_ORDER(pSb->_meta._size);
+    bool wasFull;
+
+    pthread_mutex_lock(&regionLock);
+    wasFull = isRegionFull(region);
+    region->_live--;
+
+    if (region->_live == 0) {
+        if (!wasFull)
+            unlinkRegion(region);
+        pthread_mutex_unlock(&regionLock);
+        freeCore(region, REGION_SIZE);
+        return;
+    }
+
+    pSb->_meta._pNxtSBlk = region->_freeSlots[order];
+    region->_freeSlots[order] = pSb;
+    if (wasFull)
+        linkRegion(region);
+    pthread_mutex_unlock(&regionLock);
+}
+
+int mtmm_set_huge_pages(int mode)
+{
+    if (mode != MTMM_HUGE_PAGES_OFF && mode != MTMM_HUGE_PAGES_THP && mode != MTMM_HUGE_PAGES_HUGETLB) {
+        errno = EINVAL;
+        return -1;
+    }
+    __atomic_store_n(&hugePageMode, mode, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* MTMM_HUGE_PAGES=thp or hugetlb turns the mode on at load time */
+__attribute__((constructor(101)))
+static void hugePagesFromEnvironment(void)
+{
+    const char *mode = getenv("MTMM_HUGE_PAGES");
+
+    if (!mode)
+        return;
+    if (strcmp(mode, "thp") == 0)
+        mtmm_set_huge_pages(MTMM_HUGE_PAGES_THP);
+    else if (strcmp(mode, "hugetlb") == 0)
+        mtmm_set_huge_pages(MTMM_HUGE_PAGES_HUGETLB);
+}
@@ -0,0 +1,154 @@
+/*
+ *
+ *      This module keeps the slow paths of the heap and superblock locks, see
+ *      lock.h: spinning on a held lock with exponential backoff, then sleeping
+ *      on a futex until a release wakes the thread up.
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "lock.h"
+
+/* the most pauses between two looks at a held lock */
+#define MAX_BACKOFF 64
+
+#if MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD || MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD_ADAPTIVE
+
+void lockInit(mtmm_lock_t *lock, bool shared)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    if (shared)
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#if MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD_ADAPTIVE
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+#endif
+    pthread_mutex_init(lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void lockDestroy(mtmm_lock_t *lock)
+{
+    pthread_mutex_destroy(lock);
+}
+
+#else
+
+/* pauses to spin on a held lock before sleeping; with one CPU the holder cannot
+   run while we spin, so there is no point */
+static unsigned int spinLimit = MTMM_LOCK_SPINS;
+
+__attribute__((constructor(101)))
+static void lockSpinsFromTopology(void)
+{
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        __atomic_store_n(&spinLimit, 0, __ATOMIC_RELAXED);
+}
+
+void lockInit(mtmm_lock_t *lock, bool shared)
+{
+    lock->_state = lock->_serving = lock->_sleepers = 0;
+    lock->_shared = shared;
+}
+
+void lockDestroy(mtmm_lock_t *lock)
+{
+    (void) lock;
+}
+
+/* sleep while *word still holds value, to be woken by a wake for any of the bits of mask */
+static void futexWait(mtmm_lock_t *lock, unsigned int *word, unsigned int value, unsigned int mask)
+{
+    syscall(SYS_futex, word, lock->_shared ? FUTEX_WAIT_BITSET : FUTEX_WAIT_BITSET_PRIVATE,
+            value, NULL, NULL, mask);
+}
+
+static void futexWake(mtmm_lock_t *lock, unsigned int *word, int count, unsigned int mask)
+{
+    syscall(SYS_futex, word, lock->_shared ? FUTEX_WAKE_BITSET : FUTEX_WAKE_BITSET_PRIVATE,
+            count, NULL, NULL, mask);
+}
+
+/* a pause between two looks at a held lock, easy on the sibling hyperthread */
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* wait out *backoff pauses and double it, counting them in *spins */
+static void backOff(unsigned int *backoff, unsigned int *spins)
+{
+    unsigned int i;
+
+    for (i = 0; i < *backoff; i++)
+        cpuRelax();
+    *spins += *backoff;
+    if (*backoff < MAX_BACKOFF)
+        *backoff *= 2;
+}
+
+#if MTMM_LOCK_TYPE == MTMM_LOCK_SPIN_FUTEX_FAIR
+
+/* a sleeper waits on the bit of its ticket, so a release only wakes the next in line */
+#define TICKET_BIT(ticket) (1U << ((ticket) % 32))
+
+void lockAwaitTicket(mtmm_lock_t *lock, unsigned int ticket)
+{
+    unsigned int backoff = 1, spins = 0, limit = __atomic_load_n(&spinLimit, __ATOMIC_RELAXED), serving;
+
+    while (spins < limit) {
+        backOff(&backoff, &spins);
+        if (__atomic_load_n(&lock->_serving, __ATOMIC_ACQUIRE) == ticket)
+            return;
+    }
+
+    __atomic_add_fetch(&lock->_sleepers, 1, __ATOMIC_SEQ_CST);
+    while ((serving = __atomic_load_n(&lock->_serving, __ATOMIC_SEQ_CST)) != ticket)
+        futexWait(lock, &lock->_serving, serving, TICKET_BIT(ticket));
+    __atomic_sub_fetch(&lock->_sleepers, 1, __ATOMIC_RELAXED);
+}
+
+/* wake the sleepers whose ticket may have come up, those of the tickets 32 apart
+   as well, which go back to sleep */
+void lockWake(mtmm_lock_t *lock)
+{
+    futexWake(lock, &lock->_serving, INT_MAX, TICKET_BIT(__atomic_load_n(&lock->_serving, __ATOMIC_RELAXED)));
+}
+
+#else
+
+void lockAcquireSlow(mtmm_lock_t *lock)
+{
+    unsigned int backoff = 1, spins = 0, limit = __atomic_load_n(&spinLimit, __ATOMIC_RELAXED), free;
+
+    while (spins < limit) {
+        backOff(&backoff, &spins);
+        free = 0;
+        if (__atomic_load_n(&lock->_state, __ATOMIC_RELAXED) == 0 &&
+                __atomic_compare_exchange_n(&lock->_state, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+    }
+
+    /* taken as slept on from here, so whichever thread releases it wakes another */
+    while (__atomic_exchange_n(&lock->_state, 2, __ATOMIC_ACQUIRE) != 0)
+        futexWait(lock, &lock->_state, 2, FUTEX_BITSET_MATCH_ANY);
+}
+
+void lockWake(mtmm_lock_t *lock)
+{
+    futexWake(lock, &lock->_state, 1, FUTEX_BITSET_MATCH_ANY);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,107 @@
+/*
+ * lock.h
+ *
+ *      The heap and superblock locks, of the MTMM_LOCK_TYPE chosen in mtmm.h.
+ *      The allocator's critical sections last tens of nanoseconds, far less
+ *      than a sleep and wake-up in the kernel, so its own lock spins with
+ *      exponential backoff first and only then sleeps on a futex; a release
+ *      makes a system call only when a thread may be asleep. The uncontended
+ *      paths are inline, the rest is in lock.c.
+ */
+
+#ifndef __LOCK_H__
+#define __LOCK_H__
+
+#include <stdbool.h>
+
+#include "mtmm.h"
+#include "assert_static.h"
+
+#if MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD
+#define MTMM_LOCK_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#elif MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD_ADAPTIVE
+#define MTMM_LOCK_INITIALIZER PTHREAD_ADAPTIVE_MUTEX_INITIALIZER_NP
+#else
+#define MTMM_LOCK_INITIALIZER { 0, 0, 0, 0 }
+#endif
+
+/* shared locks work across the processes mapping the memory they are in */
+void lockInit(mtmm_lock_t *lock, bool shared);
+void lockDestroy(mtmm_lock_t *lock);
+
+#if MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD || MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD_ADAPTIVE
+
+static inline void lockAcquire(mtmm_lock_t *lock)
+{
+    assert(pthread_mutex_lock(lock) == 0);
+}
+
+static inline bool lockTryAcquire(mtmm_lock_t *lock)
+{
+    return pthread_mutex_trylock(lock) == 0;
+}
+
+static inline void lockRelease(mtmm_lock_t *lock)
+{
+    assert(pthread_mutex_unlock(lock) == 0);
+}
+
+#elif MTMM_LOCK_TYPE == MTMM_LOCK_SPIN_FUTEX_FAIR
+
+/* _state is the next ticket to hand out, the holder has the one _serving */
+void lockAwaitTicket(mtmm_lock_t *lock, unsigned int ticket);
+void lockWake(mtmm_lock_t *lock);
+
+static inline void lockAcquire(mtmm_lock_t *lock)
+{
+    unsigned int ticket = __atomic_fetch_add(&lock->_state, 1, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&lock->_serving, __ATOMIC_ACQUIRE) != ticket)
+        lockAwaitTicket(lock, ticket);
+}
+
+/* free only if no ticket past the one served has been handed out */
+static inline bool lockTryAcquire(mtmm_lock_t *lock)
+{
+    unsigned int ticket = __atomic_load_n(&lock->_serving, __ATOMIC_ACQUIRE);
+
+    return __atomic_compare_exchange_n(&lock->_state, &ticket, ticket + 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void lockRelease(mtmm_lock_t *lock)
+{
+    /* ordered before the look at _sleepers, which a sleeper raises before its last look at _serving */
+    __atomic_store_n(&lock->_serving, lock->_serving + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->_sleepers, __ATOMIC_SEQ_CST))
+        lockWake(lock);
+}
+
+#else
+
+void lockAcquireSlow(mtmm_lock_t *lock);
+void lockWake(mtmm_lock_t *lock);
+
+static inline bool lockTryAcquire(mtmm_lock_t *lock)
+{
+    unsigned int free = 0;
+
+    return __atomic_compare_exchange_n(&lock->_state, &free, 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void lockAcquire(mtmm_lock_t *lock)
+{
+    if (!lockTryAcquire(lock))
+        lockAcquireSlow(lock);
+}
+
+static inline void lockRelease(mtmm_lock_t *lock)
+{
+    if (__atomic_exchange_n(&lock->_state, 0, __ATOMIC_RELEASE) == 2)
+        lockWake(lock);
+}
+
+#endif
+
+#endif /* __LOCK_H__ */
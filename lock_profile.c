@@ -0,0 +1,132 @@
+/*
+ *
+ *      This module collects and reports lock contention per lock class and call
+ *      site. Counters are relaxed atomics since superblock locks all share one
+ *      class. Reports are formatted without allocating.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "lock_profile.h"
+#include "stats.h"
+
+static mtmm_lock_stats_t lockStats;
+
+static const char *siteNames[MTMM_LOCK_SITES] = {
+    "malloc",
+    "malloc slow path",
+    "free",
+    "free relock retry",
+    "free migration",
+    "other"
+};
+
+#ifdef MTMM_LOCK_PROFILE
+
+void lockProfileRecord(int lockClass, mtmm_lock_site_t site, bool contended, unsigned long long waitNs)
+{
+    mtmm_lock_counters_t *counters = &lockStats._counters[lockClass][site];
+
+    __atomic_fetch_add(&counters->_acquisitions, 1, __ATOMIC_RELAXED);
+    if (contended) {
+        __atomic_fetch_add(&counters->_contended, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&counters->_waitNs, waitNs, __ATOMIC_RELAXED);
+    }
+}
+
+/* the report goes to stderr at exit, through a stack buffer so nothing is allocated */
+__attribute__((destructor))
+static void _report_at_exit(void)
+{
+    char report[4096];
+    int length = mtmm_lock_stats_report(report, sizeof(report));
+
+    if (length >= (int) sizeof(report)) {
+        length = sizeof(report) - 1;
+    }
+    if (length > 0 && write(2, report, length) != length) {
+        /* best effort */
+    }
+}
+
+#endif /* MTMM_LOCK_PROFILE */
+
+void mtmm_lock_stats(mtmm_lock_stats_t *stats)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < MTMM_LOCK_CLASSES; i++) {
+        for (j = 0; j < MTMM_LOCK_SITES; j++) {
+            stats->_counters[i][j]._acquisitions =
+                __atomic_load_n(&lockStats._counters[i][j]._acquisitions, __ATOMIC_RELAXED);
+            stats->_counters[i][j]._contended =
+                __atomic_load_n(&lockStats._counters[i][j]._contended, __ATOMIC_RELAXED);
+            stats->_counters[i][j]._waitNs =
+                __atomic_load_n(&lockStats._counters[i][j]._waitNs, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+int mtmm_lock_stats_report(char *buffer, size_t length)
+{
+    mtmm_lock_stats_t stats;
+    mtmm_lock_counters_t *counters = NULL;
+    /* (class, site) pairs that saw contention, sorted by total wait */
+    unsigned int order[MTMM_LOCK_CLASSES * MTMM_LOCK_SITES];
+    unsigned int count = 0, i, j, best, tmp, lockClass, site;
+    char className[32];
+    int written = 0;
+
+    mtmm_lock_stats(&stats);
+
+    for (i = 0; i < MTMM_LOCK_CLASSES * MTMM_LOCK_SITES; i++) {
+        if (stats._counters[i / MTMM_LOCK_SITES][i % MTMM_LOCK_SITES]._contended > 0) {
+            order[count++] = i;
+        }
+    }
+
+    /* few entries - a selection sort will do */
+    for (i = 0; i < count; i++) {
+        best = i;
+        for (j = i + 1; j < count; j++) {
+            if (stats._counters[order[j] / MTMM_LOCK_SITES][order[j] % MTMM_LOCK_SITES]._waitNs >
+                stats._counters[order[best] / MTMM_LOCK_SITES][order[best] % MTMM_LOCK_SITES]._waitNs) {
+                best = j;
+            }
+        }
+        tmp = order[i];
+        order[i] = order[best];
+        order[best] = tmp;
+    }
+
+    statsAppend(buffer, length, &written, "mtmm lock contention profile\n%-12s %-18s %14s %12s %8s %14s %12s\n",
+            "lock", "site", "acquisitions", "contended", "%", "wait ms", "ns/wait");
+
+    for (i = 0; i < count; i++) {
+        lockClass = order[i] / MTMM_LOCK_SITES;
+        site = order[i] % MTMM_LOCK_SITES;
+        counters = &stats._counters[lockClass][site];
+
+        if (lockClass == MTMM_LOCK_CLASS_SUPERBLOCK) {
+            snprintf(className, sizeof(className), "superblock");
+        } else if (lockClass == GEREAL_HEAP_IX) {
+            snprintf(className, sizeof(className), "global heap");
+        } else if (IS_GLOBAL_HEAP_IX(lockClass)) {
+            snprintf(className, sizeof(className), "global %u", lockClass - NUMBER_OF_HEAPS);
+        } else {
+            snprintf(className, sizeof(className), "heap %u", lockClass);
+        }
+
+        statsAppend(buffer, length, &written, "%-12s %-18s %14llu %12llu %7.2f%% %14.3f %12llu\n",
+                className, siteNames[site], counters->_acquisitions, counters->_contended,
+                100.0 * counters->_contended / counters->_acquisitions,
+                counters->_waitNs / 1e6, counters->_waitNs / counters->_contended);
+    }
+
+    if (count == 0) {
+        statsAppend(buffer, length, &written, "no contended acquisitions\n");
+    }
+
+    return written;
+}
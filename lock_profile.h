@@ -0,0 +1,21 @@
+/*
+ * lock_profile.h
+ *
+ *      Lock contention accounting used by the lock wrappers when the library
+ *      is built with MTMM_LOCK_PROFILE.
+ */
+
+#ifndef __LOCK_PROFILE_H__
+#define __LOCK_PROFILE_H__
+
+#include <stdbool.h>
+
+#include "mtmm.h"
+
+#ifdef MTMM_LOCK_PROFILE
+
+void lockProfileRecord(int lockClass, mtmm_lock_site_t site, bool contended, unsigned long long waitNs);
+
+#endif /* MTMM_LOCK_PROFILE */
+
+#endif /* __LOCK_PROFILE_H__ */
@@ -5,54 +5,225 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include "memory_allocator.h"
+#include "trace.h"
+#include "stats.h"
+#include "lock_profile.h"
+#include "lock.h"
+#include "heap_profile.h"
+#include "probes.h"
 #include "assert_static.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
-
-static hoard_t memory;
-static pthread_mutex_t heapLocks[NUMBER_OF_HEAPS + 1];
-static char isMutexInit;
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((uintptr_t) (a) - 1))
+#define PAGE_FLOOR(x) ((x) & ~((uintptr_t) getpagesize() - 1))
+
+
+/* the process's heaps, ready from static initialisation, so malloc works
+   before any constructor has run, e.g. when preloaded into a program.
+   Shared memory heaps (see mtmm_shm_attach()) run the same code on a hoard_t
+   of their own. */
+static hoard_t memory = {
+	._heaps = {
+		[0 ... NUMBER_OF_ALL_HEAPS - 1] = {
+			._lock = MTMM_LOCK_INITIALIZER,
+			._pHoard = &memory
+		}
+	}
+};
+
+/* the index of a heap in its hoard, which also names its lock class */
+#define HEAP_INDEX(pHeap) ((int) ((pHeap) - (pHeap)->_pHoard->_heaps))
+
+/* soft limit state, see mtmm_set_soft_limit() */
+static size_t softLimit;
+static bool memoryPressure;
+/* the footprint after the last purge, purging again only pays once it has grown */
+static size_t reliefFootprint;
+static mtmm_pressure_callback_t pressureCallback;
+static void *pressureCallbackArg;
+static __thread bool inPressureRelief;
+
+/* adaptive heap assignment, see mtmm_set_adaptive_heaps() */
+static bool adaptiveHeaps;
+/* contended acquisitions of each private heap's lock, halved whenever a thread
+   picks a heap so that old contention fades */
+static unsigned int heapContention[NUMBER_OF_HEAPS + 1];
+/* the heap a thread sticks to, 0 until it first allocates, and the thread's own
+   contended acquisitions in CONTENTION_STEP units, decaying by 1/16 per
+   uncontended one */
+static __thread int threadHeap;
+static __thread unsigned int threadContention;
+
+#define CONTENTION_STEP 256
+/* a thread moves on once it found its heap taken twice in short succession */
+#define CONTENTION_MOVE (2 * CONTENTION_STEP)
+
+/* adaptive migration, see mtmm_set_adaptive_migration(). Windows are counted in
+   acquisitions of the heap's lock, which every malloc and free on it makes. */
+static bool adaptiveMigration = true;
+/* a superblock moving back within this many acquisitions is a bounce */
+#define BOUNCE_WINDOW 16384
+/* a heap steps its slack down after this many without a bounce */
+#define CALM_WINDOW 131072
 
 /* Functions that wrap the pthread lock functions with asserts
    for return code verification. With verify with assert because
    we cannot handle such an error otherwise.
+   The lock class (heap index or MTMM_LOCK_CLASS_SUPERBLOCK) and call site
+   are only used when built with MTMM_LOCK_PROFILE.
  */
-static void _lock_mutex(pthread_mutex_t *mutex);
-static void _unlock_mutex(pthread_mutex_t *mutex);
+static void _lock_mutex(mtmm_lock_t *mutex, int lockClass, mtmm_lock_site_t site);
+static bool _trylock_mutex(mtmm_lock_t *mutex, int lockClass, mtmm_lock_site_t site);
+static void _unlock_mutex(mtmm_lock_t *mutex);
 
+/* The Hoard algorithm itself. The exported entry points wrap these so that
+   calls made internally (e.g. realloc going through malloc) are not traced
+   or counted twice.
+ */
+static void *hoardMalloc(size_t sz);
+static void *hoardAlignedMalloc(hoard_t *pHoard, size_t alignment, size_t sz);
+static void hoardFree(void *ptr);
+static void hoardFreeSmall(block_header_t *pBlock);
+
+/* blocks larger than S/2 or more aligned than any superblock, mapped on their own */
+static void *largeMalloc(size_t sz, size_t alignment);
+static void largeFree(block_header_t *pBlock);
+static bool isLargeBlock(const block_header_t *pBlock);
+
+/* steps of the Hoard algorithm shared by the single and batch entry points */
+static int lockThreadHeap(hoard_t *pHoard);
+static int leastContendedHeap(int heapIndex);
+static superblock_t *findSuperblockForHeap(hoard_t *pHoard, int heapIndex, int sizeClassIndex);
+static superblock_t *adoptSuperblock(hoard_t *pHoard, int heapIndex, int globalIndex, int sizeClassIndex);
+static superblock_t *adoptRemoteSuperblock(hoard_t *pHoard, int heapIndex, int sizeClassIndex);
+static superblock_t *makeSuperblockForHeap(hoard_t *pHoard, int heapIndex, int sizeClassIndex, int flags);
+static cpuheap_t *lockOwnerHeap(superblock_t *pSb);
+static bool donateMostlyEmptySuperblock(cpuheap_t *pHeap);
+static void noteMigration(cpuheap_t *pHeap, int sizeClassIndex, superblock_t *pSb, bool in);
+static void relaxMigrationPolicy(cpuheap_t *pHeap);
+
+/* soft limit enforcement, called with no lock held after memory was mapped */
+static void checkMemoryPressure(void);
+static void setMemoryPressure(bool pressure);
+static void purgeGlobalHeap(void);
+
+
+/* the NUMA node of a heap: private heap i is on node (i - 1) % nodes */
+static unsigned int nodeOfHeap(int heapIndex) {
+	if (heapIndex == GEREAL_HEAP_IX)
+		return 0;
+	if (heapIndex > NUMBER_OF_HEAPS)
+		return heapIndex - NUMBER_OF_HEAPS;
+	return (heapIndex - 1) % numaNodeCount();
+}
 
 /*
- * calculate hashed heap ID - returns either 1 or 2
+ * calculate hashed heap ID - returns 1 .. NUMBER_OF_HEAPS
+ * with several NUMA nodes, one of the heaps of the node the thread runs on
  */
 int getHeapID() {
 	int heapid;
-	pthread_t self;
-	self = pthread_self();
-	heapid = self % 2;
+	unsigned int self, nodes, node;
+	/* pthread_self() is an aligned address, its low bits are all the same */
+	self = (unsigned int) (((uint64_t) pthread_self() * 0x9E3779B97F4A7C15ULL) >> 32);
+
+	nodes = numaNodeCount();
+	if (nodes > 1) {
+		/* the node's heaps are 1 + node, 1 + node + nodes, ... */
+		node = numaCurrentNode() % nodes;
+		return 1 + node + nodes * (self % ((NUMBER_OF_HEAPS - 1 - node) / nodes + 1));
+	}
+
+	heapid = self % NUMBER_OF_HEAPS;
 	heapid++; /* 0 is reserved for general heap so we add 1 */
 	return heapid;
 
 }
 
 /*
- * initalize the heap level mutexes
+ * lock the calling thread's heap (malloc steps #2, #3) and return its index.
+ * In adaptive mode a thread sticks to one heap of its node and only trylocks it.
+ * When it finds the heap taken too often it moves to the least contended heap of
+ * its node, so waits stay rare with the heap count left as it is.
  */
-void initMutexes() {
-	int i;
-	for (i = 0; i < NUMBER_OF_HEAPS + 1; i++)
-		if (pthread_mutex_init(&heapLocks[i], NULL) != 0) {
-			printf("\n mutex init failed\n");
-			exit(-1);
+static int lockThreadHeap(hoard_t *pHoard) {
+	int heapIndex;
+	unsigned int nodes;
+	bool moved = false;
+
+	if (!__atomic_load_n(&adaptiveHeaps, __ATOMIC_RELAXED)) {
+		heapIndex = getHeapID();
+		_lock_mutex(&pHoard->_heaps[heapIndex]._lock, heapIndex, MTMM_LOCK_SITE_MALLOC);
+		pHoard->_heaps[heapIndex]._counters._lockAcquisitions++;
+		return heapIndex;
+	}
+
+	/* a thread the scheduler moved to another node starts over there */
+	heapIndex = threadHeap;
+	nodes = numaNodeCount();
+	if (!heapIndex || (nodes > 1 && nodeOfHeap(heapIndex) != numaCurrentNode() % nodes))
+		heapIndex = threadHeap = getHeapID();
+
+	if (_trylock_mutex(&pHoard->_heaps[heapIndex]._lock, heapIndex, MTMM_LOCK_SITE_MALLOC)) {
+		threadContention -= threadContention >> 4;
+	} else {
+		__atomic_add_fetch(&heapContention[heapIndex], 1, __ATOMIC_RELAXED);
+		threadContention += CONTENTION_STEP;
+		if (threadContention >= CONTENTION_MOVE) {
+			threadContention = 0;
+			threadHeap = leastContendedHeap(heapIndex);
+			moved = threadHeap != heapIndex;
+			heapIndex = threadHeap;
+		}
+		_lock_mutex(&pHoard->_heaps[heapIndex]._lock, heapIndex, MTMM_LOCK_SITE_MALLOC);
+	}
+
+	pHoard->_heaps[heapIndex]._counters._lockAcquisitions++;
+	if (moved)
+		pHoard->_heaps[heapIndex]._counters._threadsMovedIn++;
+	return heapIndex;
+}
+
+/* the heap of heapIndex's node with the least contention, heapIndex on a tie */
+static int leastContendedHeap(int heapIndex) {
+	unsigned int nodes = numaNodeCount(), contention, least = UINT_MAX;
+	int i, best = heapIndex;
+
+	for (i = 1 + nodeOfHeap(heapIndex); i <= NUMBER_OF_HEAPS; i += nodes) {
+		/* racing updates may be lost, the counts only need to be about right */
+		contention = __atomic_load_n(&heapContention[i], __ATOMIC_RELAXED);
+		__atomic_store_n(&heapContention[i], contention / 2, __ATOMIC_RELAXED);
+		if (contention < least || (contention == least && i == heapIndex)) {
+			least = contention;
+			best = i;
 		}
+	}
+	return best;
+}
+
+void mtmm_set_adaptive_heaps(int enable) {
+	__atomic_store_n(&adaptiveHeaps, enable != 0, __ATOMIC_RELAXED);
+}
 
-	isMutexInit = 1; /* so that we won't init again */
+/* MTMM_ADAPTIVE_HEAPS=1 turns the adaptive mode on at load time */
+__attribute__((constructor))
+static void adaptiveHeapsFromEnvironment(void) {
+	const char *adaptive = getenv("MTMM_ADAPTIVE_HEAPS");
 
+	if (adaptive && *adaptive == '1')
+		mtmm_set_adaptive_heaps(1);
 }
 
 /*
@@ -82,97 +253,76 @@ void initMutexes() {
  17. Unlock heap i.
  18. Return a block from the superblock.
  */
-
 void * malloc(size_t sz) {
+	void *p = hoardMalloc(sz);
 
-	int heapIndex, sizeClassIndex;
-	superblock_t *pSb;
-	void *p;
-
+	TRACE_RECORD(TRACE_OP_MALLOC, sz, p, NULL);
+	HEAP_PROFILE_ALLOC(p, sz);
+	return p;
+}
 
-	/* printf("TODO: remove this debugging output\n"); */
+static void *hoardMalloc(size_t sz) {
+	return hoardAlignedMalloc(&memory, MTMM_MIN_ALIGNMENT, sz);
+}
 
-	/* #1 */
-	if (sz > SUPERBLOCK_SIZE / 2) {
-		/* in order to identify that this block is large when we free it,
-		 * we add a header with the size
-		 */
+/* malloc from the hoard of the attached shared memory segment */
+void *mtmm_shm_malloc(size_t sz) {
+	hoard_t *pHoard = shmHoard();
+	void *p;
 
-		/* allocate memory to satisfy the large request and overheads*/
-		block_header_t *p = getCore(sz + sizeof(block_header_t));
-		if (!p){
-			/* memory allocation failed*/
-			return NULL;
-		}
-		/* the block header goes first, so p++*/
-		p->size = sz;
-		p++;
-		return (void*) p;
+	if (!pHoard) {
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	if (!isMutexInit)
-		initMutexes();
-
-	/* #2 */
-	heapIndex = getHeapID();
-
-
-
-	/* #3 */
-	_lock_mutex(&heapLocks[heapIndex]);
+	p = hoardAlignedMalloc(pHoard, MTMM_MIN_ALIGNMENT, sz);
+	if (!p)
+		errno = ENOMEM;
+	TRACE_RECORD(TRACE_OP_MALLOC, sz, p, NULL);
+	HEAP_PROFILE_ALLOC(p, sz);
+	return p;
+}
 
+/* malloc for an alignment that is a power of two, at least MTMM_MIN_ALIGNMENT */
+static void *hoardAlignedMalloc(hoard_t *pHoard, size_t alignment, size_t sz) {
 
+	int heapIndex, sizeClassIndex;
+	superblock_t *pSb;
+	void *p;
 
-	/* #4 */
-	sizeClassIndex = getSizeClassIndex(sz);
-
-	/* look in heap i to see if a superblock of relevant size class is found in a private heap*/
-	pSb = findAvailableSuperblock(
-			&(memory._heaps[heapIndex]._sizeClasses[sizeClassIndex]));
 
+	/* printf("TODO: remove this debugging output\n"); */
 
-	/* #5 && #6 */
-	if (!pSb
-			&& (pSb =
-					findAvailableSuperblock(/* search in general heap */
-							&(memory._heaps[GEREAL_HEAP_IX]._sizeClasses[sizeClassIndex])))) {
+	/* #1 */
+	if (sz > SUPERBLOCK_SIZE / 2 || alignment > MTMM_MAX_CLASS_ALIGNMENT) {
+		return pHoard->_shared ? shmLargeMalloc(sz, alignment) : largeMalloc(sz, alignment);
+	}
 
-		/* superblock of relevant size class was found in general heap
-		 * relocate it to private heap step #10
-		 */
+	/* #2, #3 */
+	heapIndex = lockThreadHeap(pHoard);
 
-		/* #11 #13 */
-        _lock_mutex(&(pSb->_meta._sbLock));
-		removeSuperblockFromHeap(&(memory._heaps[GEREAL_HEAP_IX]),
-				sizeClassIndex, pSb);
 
-		/* #12 #14 */
-		addSuperblockToHeap(&(memory._heaps[heapIndex]), sizeClassIndex, pSb);
-		_unlock_mutex(&(pSb->_meta._sbLock));
 
-	}
+	/* #4 */
+	sizeClassIndex = getAlignedSizeClassIndex(sz, alignment);
 
-	/* #7 */
+	/* #5 - #14 */
+	pSb = findSuperblockForHeap(pHoard, heapIndex, sizeClassIndex);
 	if (!pSb) {
-		/* superblock of relevant size not found anywhere
-		 * generate it
-		 */
-		pSb = makeSuperblock(pow(2.0, sizeClassIndex));
-
-		/*#8*/
-		addSuperblockToHeap(&(memory._heaps[heapIndex]), sizeClassIndex, pSb);
-
-
+		_unlock_mutex(&pHoard->_heaps[heapIndex]._lock);
+		return NULL;
 	}
 
 	/* #15, #16 */
-	/* this is redundant, but there is no init for heap */
-	if (memory._heaps[heapIndex]._CpuId != heapIndex)
-		memory._heaps[heapIndex]._CpuId = heapIndex;
-
 	p = allocateBlockFromCurrentHeap(pSb);
+	getBlockHeaderForPtr(p)->size = sz;
+	pSb->_meta._bytesRequested += sz;
+
+	_unlock_mutex(&pHoard->_heaps[heapIndex]._lock);
 
-	_unlock_mutex(&heapLocks[heapIndex]);
+	/* the soft limit is on the process's own memory */
+	if (__atomic_load_n(&softLimit, __ATOMIC_RELAXED) && !pHoard->_shared)
+		checkMemoryPressure();
 
 	return p;
 
@@ -201,8 +351,12 @@ void * malloc(size_t sz) {
  13. Unlock heap i and the superblock.
  */
 void free(void *ptr) {
+	TRACE_RECORD(TRACE_OP_FREE, 0, ptr, NULL);
+	hoardFree(ptr);
+}
+
+static void hoardFree(void *ptr) {
 
-	cpuheap_t *pHeap;
 	block_header_t *pBlock;
 
 
@@ -211,82 +365,98 @@ void free(void *ptr) {
 	}
 
 	pBlock= getBlockHeaderForPtr(ptr);
+	HEAP_PROFILE_FREE(pBlock);
 
 
 
 	/* #1 */
-	if (pBlock->size > SUPERBLOCK_SIZE / 2) {
-		freeCore((void*) pBlock, (pBlock->size + sizeof(block_header_t)));
+	if (isLargeBlock(pBlock)) {
+		largeFree(pBlock);
 		return;
 	}
 
-	superblock_t *pSb = pBlock->_pOwner;
-	_lock_mutex(&(pSb->_meta._sbLock));
-
-	/* #3 */
-	pHeap = pSb->_meta._pOwnerHeap;
-
-
-	/* #4 */
-
-	_unlock_mutex(&(pSb->_meta._sbLock));
-	_lock_mutex(&heapLocks[pHeap->_CpuId]);
-
-	if (pHeap!= pSb->_meta._pOwnerHeap){
-		/* we've locked the wrong heap - the superblock has moved
-		 * unlock and relock the uptodate heap*/
-		_unlock_mutex(&heapLocks[pHeap->_CpuId]);
-		_lock_mutex(&(pSb->_meta._sbLock));
-		pHeap=pSb->_meta._pOwnerHeap;
-		_unlock_mutex(&(pSb->_meta._sbLock));
-		_lock_mutex(&heapLocks[pHeap->_CpuId]);
-
-	}
-
+	hoardFreeSmall(pBlock);
+}
 
+/* free steps #3 - #13, for a block known to be in a superblock */
+static void hoardFreeSmall(block_header_t *pBlock) {
 
+	cpuheap_t *pHeap;
 
+	/* #3, #4 */
+	pHeap = lockOwnerHeap(pBlock->_pOwner);
 
 	/* #5, #6, #7 */
 	freeBlockFromCurrentHeap(pBlock);
 
 
 	/* #8 */
-	if (pHeap->_CpuId == GEREAL_HEAP_IX) {
-		_unlock_mutex(&heapLocks[pHeap->_CpuId]);
+	if (IS_GLOBAL_HEAP_IX(HEAP_INDEX(pHeap))) {
+		_unlock_mutex(&pHeap->_lock);
 		return;
 	}
-	/* #9 */
 
+	/* #9 */
+	relaxMigrationPolicy(pHeap);
 	if (isHeapUnderUtilized(pHeap)) {
-		superblock_t *pSbToRelocate = findMostlyEmptySuperblock(pHeap);
+		/* #10, #11, #12 */
+		donateMostlyEmptySuperblock(pHeap);
+	}
 
+	/* #13 */
+	_unlock_mutex(&pHeap->_lock);
+	return;
 
-		/* #10 */
-		if (pSbToRelocate ) {
-			size_t sizeClassIndex = getSizeClassIndex(
-					pSbToRelocate->_meta._sizeClassBytes);
+}
 
 
-			/* #11 #12 */
-			_lock_mutex(&(pSbToRelocate->_meta._sbLock));
-			removeSuperblockFromHeap(pHeap, sizeClassIndex, pSbToRelocate);
+/*
+ * sized free: the caller's size (and alignment) tells a large block from a small
+ * one, so the header is not read for it and small blocks go straight to the
+ * superblock. size must be the size that was asked for, or any size up to
+ * malloc_usable_size(ptr).
+ */
+void free_sized(void *ptr, size_t size) {
+	free_aligned_sized(ptr, MTMM_MIN_ALIGNMENT, size);
+}
 
-			/* #11 #12 */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) {
+	block_header_t *pBlock;
 
-			addSuperblockToHeap(&(memory._heaps[GEREAL_HEAP_IX]),
-					sizeClassIndex, pSbToRelocate);
-			_unlock_mutex(&(pSbToRelocate->_meta._sbLock));
-			memory._heaps[GEREAL_HEAP_IX]._CpuId=0;
+	TRACE_RECORD(TRACE_OP_FREE, 0, ptr, NULL);
+	if (!ptr)
+		return;
 
+	pBlock = getBlockHeaderForPtr(ptr);
+	HEAP_PROFILE_FREE(pBlock);
 
-		}
-	}
+	if (size > SUPERBLOCK_SIZE / 2 || alignment > MTMM_MAX_CLASS_ALIGNMENT)
+		largeFree(pBlock);
+	else
+		hoardFreeSmall(pBlock);
+}
 
-	/* #13 */
-	_unlock_mutex(&heapLocks[pHeap->_CpuId]);
-	return;
+/*
+ * the bytes that can be used at ptr: up to the next block's header for a small
+ * block, up to the end of the last page for a large one
+ */
+size_t malloc_usable_size(void *ptr) {
+	block_header_t *pBlock;
+	superblock_t *pSb;
+	size_t usable;
+
+	if (!ptr)
+		return 0;
 
+	pBlock = getBlockHeaderForPtr(ptr);
+	if (isLargeBlock(pBlock))
+		return PAGE_FLOOR((uintptr_t) ptr + pBlock->size + getpagesize() - 1) - (uintptr_t) ptr;
+
+	/* kept within S/2, so the size still names the small path in free_sized() */
+	pSb = pBlock->_pOwner;
+	usable = getBlockActualSizeInBytes(pSb->_meta._sizeClassBytes, pSb->_meta._alignment)
+			- sizeof(block_header_t);
+	return usable < SUPERBLOCK_SIZE / 2 ? usable : SUPERBLOCK_SIZE / 2;
 }
 
 
@@ -296,63 +466,867 @@ void free(void *ptr) {
  3. free old allocation
  */
 void *realloc(void *ptr, size_t sz) {
-	void *p = malloc(sz);
-	if (!p) {
-		perror("realloc failed\n");
+	size_t size;
+	void *p;
+
+	if (ptr && !sz){
+		TRACE_RECORD(TRACE_OP_REALLOC, sz, NULL, ptr);
+		hoardFree(ptr);
 		return NULL;
 	}
-	if (!ptr)
-		return p;
 
-	if (!sz){
-		free(ptr);
+	/* a block of a shared segment stays in it */
+	p = hoardAlignedMalloc(shmContains(ptr) ? shmHoard() : &memory, MTMM_MIN_ALIGNMENT, sz);
+	if (!p) {
+		/* the old block is left as it was */
+		errno = ENOMEM;
 		return NULL;
 	}
-	block_header_t *pHeader = ptr - sizeof(block_header_t);
-	unsigned int size = pHeader->size < sz ? pHeader->size : sz;
+	HEAP_PROFILE_ALLOC(p, sz);
+	if (!ptr) {
+		TRACE_RECORD(TRACE_OP_REALLOC, sz, p, NULL);
+		return p;
+	}
+
+	/* up to what the caller may have used, more than it asked for if it read
+	   malloc_usable_size() */
+	size = malloc_usable_size(ptr);
+	if (size > sz)
+		size = sz;
 
 	memcpy(p, ptr, size);
-	free(ptr);
+	/* recorded before the old block can be handed out again to another thread */
+	TRACE_RECORD(TRACE_OP_REALLOC, sz, p, ptr);
+	hoardFree(ptr);
 	return p;
 }
 
+/* realloc of an array, failing instead of overflowing nmemb * size */
+void *reallocarray(void *ptr, size_t nmemb, size_t size) {
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, nmemb * size);
+}
+
 
 void *calloc(size_t nmemb, size_t size) {
-	void *p = malloc(nmemb * size);
-	if (p)
-		memset(p,0,size);
+	void *p = NULL;
+
+	if (size && nmemb > SIZE_MAX / size) {
+		errno = ENOMEM;
+	} else {
+		p = hoardMalloc(nmemb * size);
+		/* large blocks are fresh mappings, which are zero already */
+		if (p && nmemb * size <= SUPERBLOCK_SIZE / 2)
+			memset(p, 0, nmemb * size);
+	}
+	TRACE_RECORD(TRACE_OP_CALLOC, nmemb * size, p, NULL);
+	HEAP_PROFILE_ALLOC(p, nmemb * size);
 	return p;
 }
 
 
-/*********************************************************************************************************/
+/*
+ * the aligned entry points share this one: alignment must be a power of two,
+ * otherwise errno is set to EINVAL
+ */
+static void *alignedMalloc(size_t alignment, size_t size) {
+	void *p;
 
-superblock_t* makeSuperblock(size_t sizeClassBytes) {
+	if (alignment == 0 || (alignment & (alignment - 1))) {
+		errno = EINVAL;
+		return NULL;
+	}
 
-    block_header_t *p, *pPrev = NULL;
-    size_t netSuperblockSize = SUPERBLOCK_SIZE;
-    size_t normSuperblockSize = netSuperblockSize / sizeof(block_header_t);
+	p = hoardAlignedMalloc(&memory, alignment < MTMM_MIN_ALIGNMENT ? MTMM_MIN_ALIGNMENT : alignment, size);
+	if (!p)
+		errno = ENOMEM;
 
-    /* the offset between subsequent blocks in units of block_header_t */
-    size_t blockOffset = getBlockActualSizeInHeaders(sizeClassBytes);
+	TRACE_RECORD(TRACE_OP_MALLOC, size, p, NULL);
+	HEAP_PROFILE_ALLOC(p, size);
+	return p;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+	void *p;
+
+	if (alignment % sizeof(void *))
+		return EINVAL;
+	p = alignedMalloc(alignment, size);
+	if (!p)
+		return errno;
+
+	*memptr = p;
+	return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	return alignedMalloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+	size_t powerOfTwo = MTMM_MIN_ALIGNMENT;
+
+	while (powerOfTwo < alignment && powerOfTwo)
+		powerOfTwo <<= 1;
+	return alignedMalloc(powerOfTwo, size);
+}
+
+void *valloc(size_t size) {
+	return alignedMalloc(getpagesize(), size);
+}
+
+void *pvalloc(size_t size) {
+	size_t pageSize = getpagesize();
+
+	return alignedMalloc(pageSize, size ? ALIGN_UP(size, pageSize) : pageSize);
+}
 
-    /* the number of blocks that we'll generate in this superblock */
-    size_t numberOfBlocks = normSuperblockSize / blockOffset;
-    int i;
+
+/*
+ * batch malloc: the same steps as malloc, but the heap lock is taken once and
+ * each superblock found gives as many blocks as it has in one pop run and one
+ * relocation
+ */
+size_t mtmm_malloc_batch(size_t sz, size_t n, void **ptrs) {
+	int heapIndex, sizeClassIndex;
+	superblock_t *pSb;
+	size_t count = 0, got, i;
+
+	if (sz > SUPERBLOCK_SIZE / 2) {
+		/* each large block is its own mapping anyway */
+		for (count = 0; count < n && (ptrs[count] = hoardMalloc(sz)); count++)
+			;
+	} else {
+		heapIndex = lockThreadHeap(&memory);
+
+		sizeClassIndex = getSizeClassIndex(sz);
+		while (count < n) {
+			pSb = findSuperblockForHeap(&memory, heapIndex, sizeClassIndex);
+			if (!pSb)
+				break;
+			got = allocateBlocksFromCurrentHeap(pSb, ptrs + count, n - count);
+			for (i = count; i < count + got; i++)
+				getBlockHeaderForPtr(ptrs[i])->size = sz;
+			pSb->_meta._bytesRequested += got * sz;
+			count += got;
+		}
+
+		_unlock_mutex(&memory._heaps[heapIndex]._lock);
+
+		/* the batch may have made any number of superblocks */
+		if (__atomic_load_n(&softLimit, __ATOMIC_RELAXED))
+			checkMemoryPressure();
+	}
+
+	for (i = 0; i < count; i++) {
+		TRACE_RECORD(TRACE_OP_MALLOC, sz, ptrs[i], NULL);
+		HEAP_PROFILE_ALLOC(ptrs[i], sz);
+	}
+
+	return count;
+}
+
+/* move the pointers in [from, n) that belong to superblock pSb (or, without pSb, to a
+   superblock owned by pHeap) to the front of that range, returns the end of the run */
+static size_t partitionPointers(void **ptrs, size_t from, size_t n, cpuheap_t *pHeap, superblock_t *pSb) {
+	size_t end = from, j;
+	superblock_t *pOwner;
+	void *tmp;
+
+	for (j = from; j < n; j++) {
+		pOwner = getBlockHeaderForPtr(ptrs[j])->_pOwner;
+		if (pSb ? pOwner == pSb : pOwner->_meta._pOwnerHeap == pHeap) {
+			tmp = ptrs[end];
+			ptrs[end++] = ptrs[j];
+			ptrs[j] = tmp;
+		}
+	}
+	return end;
+}
+
+/*
+ * batch free: small blocks are grouped by owner heap, and within it by superblock.
+ * Each heap is locked once for all of its blocks, each superblock gets one push run
+ * and one relocation, and the heap is brought back within the Hoard bounds once at
+ * the end. The order of ptrs is changed.
+ */
+void mtmm_free_batch(void **ptrs, size_t n) {
+	block_header_t *pBlock;
+	cpuheap_t *pHeap;
+	superblock_t *pSb;
+	size_t i, small = 0, heapEnd, groupEnd;
+
+	/* NULLs and large blocks drop out, small ones are packed at the front */
+	for (i = 0; i < n; i++) {
+		if (!ptrs[i])
+			continue;
+
+		TRACE_RECORD(TRACE_OP_FREE, 0, ptrs[i], NULL);
+		pBlock = getBlockHeaderForPtr(ptrs[i]);
+		if (isLargeBlock(pBlock)) {
+			hoardFree(ptrs[i]);
+		} else {
+			HEAP_PROFILE_FREE(pBlock);
+			ptrs[small++] = ptrs[i];
+		}
+	}
+
+	i = 0;
+	while (i < small) {
+		pHeap = lockOwnerHeap(getBlockHeaderForPtr(ptrs[i])->_pOwner);
+
+		/* an owner read without its heap lock can only equal the heap we hold
+		   if the superblock really belongs to it */
+		heapEnd = partitionPointers(ptrs, i, small, pHeap, NULL);
+
+		while (i < heapEnd) {
+			pSb = getBlockHeaderForPtr(ptrs[i])->_pOwner;
+			groupEnd = partitionPointers(ptrs, i, heapEnd, NULL, pSb);
+			freeBlocksFromCurrentHeap(pSb, ptrs + i, groupEnd - i);
+			i = groupEnd;
+		}
+
+		if (!IS_GLOBAL_HEAP_IX(HEAP_INDEX(pHeap))) {
+			relaxMigrationPolicy(pHeap);
+			while (isHeapUnderUtilized(pHeap) && donateMostlyEmptySuperblock(pHeap))
+				;
+		}
+
+		_unlock_mutex(&pHeap->_lock);
+	}
+}
+
+
+/*
+ * find a superblock with a free block for heap i, which is locked (malloc steps #4 - #14):
+ * heap i's own superblocks first, then one adopted from the global heap of its
+ * NUMA node, then a new one. Superblocks of other nodes are adopted only when
+ * memory is short: under pressure, or when core is exhausted.
+ * Returns NULL only when core is exhausted and no node has a superblock to give.
+ */
+static superblock_t *findSuperblockForHeap(hoard_t *pHoard, int heapIndex, int sizeClassIndex) {
+	superblock_t *pSb;
+
+	/* look in heap i to see if a superblock of relevant size class is found in a private heap*/
+	pSb = findAvailableSuperblock(
+			&(pHoard->_heaps[heapIndex]._sizeClasses[sizeClassIndex]));
+
+
+	/* #5 && #6 */
+	if (!pSb)
+		pSb = adoptSuperblock(pHoard, heapIndex, GLOBAL_HEAP_IX(nodeOfHeap(heapIndex)), sizeClassIndex);
+
+	if (!pSb && __atomic_load_n(&memoryPressure, __ATOMIC_RELAXED))
+		pSb = adoptRemoteSuperblock(pHoard, heapIndex, sizeClassIndex);
+
+	/* #7 */
+	if (!pSb) {
+		/* superblock of relevant size not found anywhere
+		 * generate it
+		 */
+		pSb = makeSuperblockForHeap(pHoard, heapIndex, sizeClassIndex, 0);
+		if (pSb) {
+			/*#8*/
+			addSuperblockToHeap(&(pHoard->_heaps[heapIndex]), sizeClassIndex, pSb);
+			pHoard->_heaps[heapIndex]._counters._superblocksCreated++;
+			noteMigration(&(pHoard->_heaps[heapIndex]), sizeClassIndex, pSb, true);
+		}
+	}
+
+	if (!pSb)
+		pSb = adoptRemoteSuperblock(pHoard, heapIndex, sizeClassIndex);
+
+	return pSb;
+}
+
+/*
+ * move a superblock with a free block from a global heap to heap i, which is
+ * locked (malloc steps #9 - #14). Returns NULL if the global heap has none.
+ */
+static superblock_t *adoptSuperblock(hoard_t *pHoard, int heapIndex, int globalIndex, int sizeClassIndex) {
+	superblock_t *pSb;
+
+	/* search in general heap, which is locked after the private heap */
+	_lock_mutex(&pHoard->_heaps[globalIndex]._lock, globalIndex, MTMM_LOCK_SITE_MALLOC_SLOW_PATH);
+	pHoard->_heaps[globalIndex]._counters._lockAcquisitions++;
+
+	pSb = findAvailableSuperblock(
+			&(pHoard->_heaps[globalIndex]._sizeClasses[sizeClassIndex]));
+
+	if (pSb) {
+		/* superblock of relevant size class was found in general heap
+		 * relocate it to private heap step #10
+		 */
+
+		/* #11 #13 */
+		_lock_mutex(&(pSb->_meta._sbLock), MTMM_LOCK_CLASS_SUPERBLOCK, MTMM_LOCK_SITE_MALLOC_SLOW_PATH);
+		removeSuperblockFromHeap(&(pHoard->_heaps[globalIndex]),
+				sizeClassIndex, pSb);
+
+		/* #12 #14 */
+		addSuperblockToHeap(&(pHoard->_heaps[heapIndex]), sizeClassIndex, pSb);
+		_unlock_mutex(&(pSb->_meta._sbLock));
+		pHoard->_heaps[heapIndex]._counters._lockAcquisitions++;
+		pHoard->_heaps[heapIndex]._counters._superblocksAdopted++;
+		if (pSb->_meta._node != nodeOfHeap(heapIndex))
+			pHoard->_heaps[heapIndex]._counters._superblocksAdoptedRemote++;
+		noteMigration(&(pHoard->_heaps[heapIndex]), sizeClassIndex, pSb, true);
+		MTMM_PROBE2(superblock_adopt, pSb, heapIndex);
+	}
+
+	_unlock_mutex(&pHoard->_heaps[globalIndex]._lock);
+	return pSb;
+}
+
+/* adopt from the global heaps of the NUMA nodes other than heap i's */
+static superblock_t *adoptRemoteSuperblock(hoard_t *pHoard, int heapIndex, int sizeClassIndex) {
+	unsigned int node, nodes = numaNodeCount(), ownNode = nodeOfHeap(heapIndex);
+	superblock_t *pSb = NULL;
+
+	for (node = 0; node < nodes && !pSb; node++) {
+		if (node != ownNode)
+			pSb = adoptSuperblock(pHoard, heapIndex, GLOBAL_HEAP_IX(node), sizeClassIndex);
+	}
+	return pSb;
+}
+
+/*
+ * make a superblock for the list sizeClassIndex of heap i, placed on the heap's
+ * NUMA node before anything is written to it. In huge page mode it comes from a
+ * region of the heap, whose huge page is faulted in whole anyway, so
+ * MTMM_RESERVE_POPULATE has nothing left to do. A shared hoard's superblocks come
+ * from its segment, which is placed by whoever faults its pages in. No lock is
+ * needed.
+ */
+static superblock_t *makeSuperblockForHeap(hoard_t *pHoard, int heapIndex, int sizeClassIndex, int flags) {
+	unsigned int node = nodeOfHeap(heapIndex);
+	bool inRegion = !pHoard->_shared && hugePagesEnabled();
+	size_t sizeClassBytes = 1UL << (sizeClassIndex % NUMBER_OF_SIZE_CLASSES);
+	size_t alignment = MTMM_MIN_ALIGNMENT << (sizeClassIndex / NUMBER_OF_SIZE_CLASSES);
+	size_t size = getSuperblockSize(sizeClassBytes, alignment);
+	superblock_t *pSb;
+
+	if (pHoard->_shared) {
+		pSb = shmGetSuperblock(size);
+	} else if (inRegion) {
+		pSb = getRegionSuperblock(heapIndex, node, size);
+	} else {
+		pSb = (superblock_t*) (flags & MTMM_RESERVE_POPULATE
+				? getPopulatedCore(size)
+				: getCore(size));
+		if (pSb && numaNodeCount() > 1)
+			numaBind(pSb, size, node);
+	}
+	if (!pSb)
+		return NULL;
+
+	formatSuperblock(pSb, sizeClassBytes, alignment);
+	pSb->_meta._node = node;
+	pSb->_meta._inRegion = inRegion;
+	if (pHoard->_shared) {
+		lockDestroy(&(pSb->_meta._sbLock));
+		lockInit(&(pSb->_meta._sbLock), true);
+	}
+	return pSb;
+}
+
+/*
+ * record superblock pSb of list sizeClassIndex moving into heap i, which is locked,
+ * or out of it. Moving back within BOUNCE_WINDOW of a move the other way is a
+ * bounce, which adds the superblock's bytes to the heap's slack: a bouncing 256KB
+ * superblock needs eight times the room of a 32KB one to stay put.
+ */
+static void noteMigration(cpuheap_t *pHeap, int sizeClassIndex, superblock_t *pSb, bool in) {
+	unsigned long long now = pHeap->_counters._lockAcquisitions;
+	unsigned long long last = in ? pHeap->_donatedAt[sizeClassIndex] : pHeap->_adoptedAt[sizeClassIndex];
+
+	if (last && now - last < BOUNCE_WINDOW) {
+		pHeap->_counters._migrationBounces++;
+		if (__atomic_load_n(&hoardMaxSlack, __ATOMIC_RELAXED))
+			pHeap->_slack = pHeap->_slack + pSb->_meta._size < HOARD_MAX_SLACK
+					? pHeap->_slack + pSb->_meta._size : HOARD_MAX_SLACK;
+		pHeap->_slackChangedAt = now;
+	}
+
+	if (in)
+		pHeap->_adoptedAt[sizeClassIndex] = now;
+	else
+		pHeap->_donatedAt[sizeClassIndex] = now;
+}
+
+/* step a locked heap's slack down by SUPERBLOCK_SIZE once it has gone CALM_WINDOW without a bounce */
+static void relaxMigrationPolicy(cpuheap_t *pHeap) {
+	if (pHeap->_slack && pHeap->_counters._lockAcquisitions - pHeap->_slackChangedAt > CALM_WINDOW) {
+		pHeap->_slack = pHeap->_slack > SUPERBLOCK_SIZE ? pHeap->_slack - SUPERBLOCK_SIZE : 0;
+		pHeap->_slackChangedAt = pHeap->_counters._lockAcquisitions;
+	}
+}
+
+/*
+ * lock the heap owning a superblock (free steps #3, #4) and return it.
+ * The owner is read under the superblock lock, but it may change before the
+ * heap lock is taken, in which case we retry with the new owner. Once we hold
+ * the owner's lock it stays the owner, since moving a superblock out of a heap
+ * needs that heap's lock.
+ */
+static cpuheap_t *lockOwnerHeap(superblock_t *pSb) {
+	cpuheap_t *pHeap;
+	/* locks taken before the heap lock, accounted once it is held */
+	unsigned int lockCount = 2;
+
+	_lock_mutex(&(pSb->_meta._sbLock), MTMM_LOCK_CLASS_SUPERBLOCK, MTMM_LOCK_SITE_FREE);
+	pHeap = pSb->_meta._pOwnerHeap;
+	_unlock_mutex(&(pSb->_meta._sbLock));
+	_lock_mutex(&pHeap->_lock, HEAP_INDEX(pHeap), MTMM_LOCK_SITE_FREE);
+
+	while (pHeap!= pSb->_meta._pOwnerHeap){
+		/* we've locked the wrong heap - the superblock has moved
+		 * unlock and relock the uptodate heap*/
+		_unlock_mutex(&pHeap->_lock);
+		_lock_mutex(&(pSb->_meta._sbLock), MTMM_LOCK_CLASS_SUPERBLOCK, MTMM_LOCK_SITE_FREE_RETRY);
+		MTMM_PROBE3(free_lock_retry, pSb, HEAP_INDEX(pHeap), HEAP_INDEX(pSb->_meta._pOwnerHeap));
+		pHeap=pSb->_meta._pOwnerHeap;
+		_unlock_mutex(&(pSb->_meta._sbLock));
+		_lock_mutex(&pHeap->_lock, HEAP_INDEX(pHeap), MTMM_LOCK_SITE_FREE_RETRY);
+		lockCount += 2;
+
+	}
+	pHeap->_counters._lockAcquisitions += lockCount;
+
+	return pHeap;
+}
+
+/*
+ * transfer a mostly-empty superblock of a locked private heap to the global heap
+ * of the NUMA node it is placed on (free steps #10 - #12). Returns false if the
+ * heap has no superblock to give.
+ */
+static bool donateMostlyEmptySuperblock(cpuheap_t *pHeap) {
+	hoard_t *pHoard = pHeap->_pHoard;
+	superblock_t *pSbToRelocate = findMostlyEmptySuperblock(pHeap);
+	size_t sizeClassIndex;
+	int globalIndex;
+
+	/* #10: only a superblock with next to nothing in use, in the heap's first
+	   fullness bucket, is worth moving */
+	if (!pSbToRelocate || pSbToRelocate->_meta._fullnessBucket)
+		return false;
+
+	sizeClassIndex = getAlignedSizeClassIndex(pSbToRelocate->_meta._sizeClassBytes,
+			pSbToRelocate->_meta._alignment);
+	noteMigration(pHeap, sizeClassIndex, pSbToRelocate, false);
+
+	if (__atomic_load_n(&memoryPressure, __ATOMIC_RELAXED) && !pHoard->_shared &&
+			pSbToRelocate->_meta._NoFreeBlks == pSbToRelocate->_meta._NoBlks) {
+		/* nothing in it is live, so under pressure it goes to the OS instead */
+		_lock_mutex(&(pSbToRelocate->_meta._sbLock), MTMM_LOCK_CLASS_SUPERBLOCK, MTMM_LOCK_SITE_FREE_MIGRATION);
+		removeSuperblockFromHeap(pHeap, sizeClassIndex, pSbToRelocate);
+		_unlock_mutex(&(pSbToRelocate->_meta._sbLock));
+		pHeap->_counters._lockAcquisitions++;
+		freeSuperblock(pSbToRelocate);
+		return true;
+	}
+
+	/* a node that dropped out of the topology hands its superblocks to node 0 */
+	globalIndex = pSbToRelocate->_meta._node < numaNodeCount()
+			? GLOBAL_HEAP_IX(pSbToRelocate->_meta._node) : GEREAL_HEAP_IX;
+
+	/* #11 #12 */
+	_lock_mutex(&pHoard->_heaps[globalIndex]._lock, globalIndex, MTMM_LOCK_SITE_FREE_MIGRATION);
+	_lock_mutex(&(pSbToRelocate->_meta._sbLock), MTMM_LOCK_CLASS_SUPERBLOCK, MTMM_LOCK_SITE_FREE_MIGRATION);
+	removeSuperblockFromHeap(pHeap, sizeClassIndex, pSbToRelocate);
+	addSuperblockToHeap(&(pHoard->_heaps[globalIndex]),
+			sizeClassIndex, pSbToRelocate);
+	_unlock_mutex(&(pSbToRelocate->_meta._sbLock));
+	pHoard->_heaps[globalIndex]._counters._lockAcquisitions++;
+	_unlock_mutex(&pHoard->_heaps[globalIndex]._lock);
+
+	pHeap->_counters._lockAcquisitions++;
+	pHeap->_counters._superblocksDonated++;
+	MTMM_PROBE2(superblock_donate, pSbToRelocate, HEAP_INDEX(pHeap));
+
+	return true;
+}
+
+
+/*
+ * copy every heap's figures under its lock, then the allocator wide counters
+ */
+void mtmm_stats(mtmm_stats_t *stats) {
+	int i, j;
+	cpuheap_t *pHeap;
+	mtmm_heap_stats_t *pHeapStats;
+
+	memset(stats, 0, sizeof(*stats));
+
+	stats->_numaNodes = numaNodeCount();
+	for (i = 0; i < NUMBER_OF_ALL_HEAPS; i++) {
+		pHeap = &(memory._heaps[i]);
+		pHeapStats = &(stats->_heaps[i]);
+		pHeapStats->_node = nodeOfHeap(i);
+
+		_lock_mutex(&memory._heaps[i]._lock, i, MTMM_LOCK_SITE_OTHER);
+		pHeapStats->_bytesUsed = pHeap->_bytesUsed;
+		pHeapStats->_bytesAvailable = pHeap->_bytesAvailable;
+		pHeapStats->_slack = pHeap->_slack;
+		/* aligned lists are counted with their size class */
+		memset(pHeapStats->_superblocks, 0, sizeof(pHeapStats->_superblocks));
+		for (j = 0; j < NUMBER_OF_SIZE_CLASS_LISTS; j++)
+			pHeapStats->_superblocks[j % NUMBER_OF_SIZE_CLASSES] += pHeap->_sizeClasses[j]._SBlkList._length;
+		pHeapStats->_counters = pHeap->_counters;
+		_unlock_mutex(&memory._heaps[i]._lock);
+
+		stats->_migrations += pHeapStats->_counters._superblocksAdopted
+				+ pHeapStats->_counters._superblocksDonated;
+		stats->_lockAcquisitions += pHeapStats->_counters._lockAcquisitions;
+	}
+
+	stats->_largeAllocations = STATS_READ(_largeAllocations);
+	stats->_largeFrees = STATS_READ(_largeFrees);
+	stats->_largeBytesMapped = STATS_READ(_largeBytesMapped);
+	stats->_mmapCalls = STATS_READ(_mmapCalls);
+	stats->_munmapCalls = STATS_READ(_munmapCalls);
+	stats->_coreBytesMapped = STATS_READ(_coreBytesMapped);
+	stats->_superblocksPurged = STATS_READ(_superblocksPurged);
+}
+
+/*
+ * hand every superblock of every heap to callback, a heap at a time under its lock.
+ * Only the superblock's metadata is read, never the blocks themselves.
+ */
+void mtmm_heap_walk(mtmm_heap_walk_callback_t callback, void *arg) {
+	mtmm_superblock_info_t info;
+	size_class_t *pSizeClass;
+	superblock_t *pSb;
+	unsigned int k;
+	int i, j;
+
+	for (i = 0; i < NUMBER_OF_ALL_HEAPS; i++) {
+		_lock_mutex(&memory._heaps[i]._lock, i, MTMM_LOCK_SITE_OTHER);
+		for (j = 0; j < NUMBER_OF_SIZE_CLASS_LISTS; j++) {
+			pSizeClass = &(memory._heaps[i]._sizeClasses[j]);
+			pSb = pSizeClass->_SBlkList._first;
+			for (k = 0; k < pSizeClass->_SBlkList._length; k++, pSb = pSb->_meta._pNxtSBlk) {
+				info._address = pSb;
+				info._heap = i;
+				info._node = pSb->_meta._node;
+				info._sizeClassBytes = pSb->_meta._sizeClassBytes;
+				info._alignment = pSb->_meta._alignment;
+				info._blockBytes = getBlockActualSizeInBytes(pSb->_meta._sizeClassBytes, pSb->_meta._alignment);
+				info._blocks = pSb->_meta._NoBlks;
+				info._freeBlocks = pSb->_meta._NoFreeBlks;
+				info._bytesRequested = pSb->_meta._bytesRequested;
+				info._bytes = pSb->_meta._size;
+				callback(&info, arg);
+			}
+		}
+		_unlock_mutex(&memory._heaps[i]._lock);
+	}
+}
+
+
+void mtmm_set_soft_limit(size_t bytes) {
+	__atomic_store_n(&reliefFootprint, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&softLimit, bytes, __ATOMIC_RELAXED);
+	if (!bytes)
+		setMemoryPressure(false);
+}
+
+void mtmm_set_pressure_callback(mtmm_pressure_callback_t callback, void *arg) {
+	pressureCallbackArg = arg;
+	__atomic_store_n(&pressureCallback, callback, __ATOMIC_RELEASE);
+}
+
+/* private heaps donate with lower K and f while the allocator is over its limit */
+static void setMemoryPressure(bool pressure) {
+	if (__atomic_exchange_n(&memoryPressure, pressure, __ATOMIC_RELAXED) == pressure)
+		return;
+
+	__atomic_store_n(&hoardK, pressure ? HOARD_K / 2 : HOARD_K, __ATOMIC_RELAXED);
+	hoardEmptyFraction = pressure ? HOARD_EMPTY_FRACTION / 2 : HOARD_EMPTY_FRACTION;
+	__atomic_store_n(&hoardMaxSlack, !pressure && __atomic_load_n(&adaptiveMigration, __ATOMIC_RELAXED)
+			? HOARD_MAX_SLACK : 0, __ATOMIC_RELAXED);
+}
+
+void mtmm_set_adaptive_migration(int enable) {
+	__atomic_store_n(&adaptiveMigration, enable != 0, __ATOMIC_RELAXED);
+	if (!__atomic_load_n(&memoryPressure, __ATOMIC_RELAXED))
+		__atomic_store_n(&hoardMaxSlack, enable ? HOARD_MAX_SLACK : 0, __ATOMIC_RELAXED);
+}
+
+/* MTMM_ADAPTIVE_MIGRATION=0 turns the adaptive migration policy off at load time */
+__attribute__((constructor))
+static void adaptiveMigrationFromEnvironment(void) {
+	const char *adaptive = getenv("MTMM_ADAPTIVE_MIGRATION");
+
+	if (adaptive && *adaptive == '0')
+		mtmm_set_adaptive_migration(0);
+}
+
+/* give every empty superblock of the global heaps of all nodes back to the OS */
+static void purgeGlobalHeap(void) {
+	cpuheap_t *pHeap;
+	size_class_t *pSizeClass;
+	superblock_t *pSb;
+	int i, node, globalIndex;
+
+	for (node = 0; node < MTMM_MAX_NUMA_NODES; node++) {
+		globalIndex = GLOBAL_HEAP_IX(node);
+		pHeap = &(memory._heaps[globalIndex]);
+
+		_lock_mutex(&memory._heaps[globalIndex]._lock, globalIndex, MTMM_LOCK_SITE_OTHER);
+		pHeap->_counters._lockAcquisitions++;
+		for (i = 0; i < NUMBER_OF_SIZE_CLASS_LISTS; i++) {
+			pSizeClass = &(pHeap->_sizeClasses[i]);
+
+			/* lists run from the fullest to the emptiest, so the empty ones are last */
+			while (pSizeClass->_SBlkList._length) {
+				pSb = pSizeClass->_SBlkList._first->_meta._pPrvSblk;
+				if (pSb->_meta._NoFreeBlks != pSb->_meta._NoBlks)
+					break;
+
+				_lock_mutex(&(pSb->_meta._sbLock), MTMM_LOCK_CLASS_SUPERBLOCK, MTMM_LOCK_SITE_OTHER);
+				removeSuperblockFromHeap(pHeap, i, pSb);
+				_unlock_mutex(&(pSb->_meta._sbLock));
+				pHeap->_counters._lockAcquisitions++;
+				freeSuperblock(pSb);
+			}
+		}
+		_unlock_mutex(&memory._heaps[globalIndex]._lock);
+	}
+}
+
+static void checkMemoryPressure(void) {
+	size_t limit = __atomic_load_n(&softLimit, __ATOMIC_RELAXED);
+	size_t footprint = STATS_READ(_coreBytesMapped);
+	mtmm_pressure_callback_t callback;
+
+	if (footprint <= limit) {
+		if (footprint < limit - limit / 8 && __atomic_load_n(&memoryPressure, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&reliefFootprint, 0, __ATOMIC_RELAXED);
+			setMemoryPressure(false);
+		}
+		return;
+	}
+
+	/* nothing grew since the last purge, or the callback is allocating */
+	if (footprint <= __atomic_load_n(&reliefFootprint, __ATOMIC_RELAXED) || inPressureRelief)
+		return;
+
+	inPressureRelief = true;
+	MTMM_PROBE2(memory_pressure, footprint, limit);
+
+	setMemoryPressure(true);
+	purgeGlobalHeap();
+	arenaPoolFlush();
+
+	footprint = STATS_READ(_coreBytesMapped);
+	__atomic_store_n(&reliefFootprint, footprint, __ATOMIC_RELAXED);
+
+	callback = __atomic_load_n(&pressureCallback, __ATOMIC_ACQUIRE);
+	if (footprint > limit && callback)
+		callback(footprint, limit, pressureCallbackArg);
+
+	inPressureRelief = false;
+}
+
+
+/*
+ * give every private heap superblocks of the size class of size until it has count
+ * free blocks of that class. The superblocks are made and formatted (and with
+ * MTMM_RESERVE_POPULATE faulted in) without any heap lock held, then linked in.
+ */
+int mtmm_reserve(size_t size, size_t count, int flags) {
+	int heapIndex, sizeClassIndex;
+	unsigned int i;
+	size_class_t *pSizeClass;
+	superblock_t *pSb, *pMade;
+	size_t freeBlocks;
+
+	if (size == 0 || size > SUPERBLOCK_SIZE / 2) {
+		errno = EINVAL;
+		return -1;
+	}
+	sizeClassIndex = getSizeClassIndex(size);
+
+	for (heapIndex = 1; heapIndex <= NUMBER_OF_HEAPS; heapIndex++) {
+		pSizeClass = &(memory._heaps[heapIndex]._sizeClasses[sizeClassIndex]);
+
+		_lock_mutex(&memory._heaps[heapIndex]._lock, heapIndex, MTMM_LOCK_SITE_OTHER);
+		freeBlocks = 0;
+		pSb = pSizeClass->_SBlkList._first;
+		for (i = 0; i < pSizeClass->_SBlkList._length; i++, pSb = pSb->_meta._pNxtSBlk)
+			freeBlocks += pSb->_meta._NoFreeBlks;
+		_unlock_mutex(&memory._heaps[heapIndex]._lock);
+
+		/* chained through their list pointers until they are linked in */
+		pMade = NULL;
+		while (freeBlocks < count) {
+			pSb = makeSuperblockForHeap(&memory, heapIndex, sizeClassIndex, flags);
+			if (!pSb)
+				break;
+			freeBlocks += pSb->_meta._NoBlks;
+			pSb->_meta._pNxtSBlk = pMade;
+			pMade = pSb;
+		}
+
+		_lock_mutex(&memory._heaps[heapIndex]._lock, heapIndex, MTMM_LOCK_SITE_OTHER);
+		while (pMade) {
+			pSb = pMade;
+			pMade = pSb->_meta._pNxtSBlk;
+			addSuperblockToHeap(&(memory._heaps[heapIndex]), sizeClassIndex, pSb);
+			memory._heaps[heapIndex]._counters._superblocksCreated++;
+		}
+		_unlock_mutex(&memory._heaps[heapIndex]._lock);
+
+		if (freeBlocks < count) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int mtmm_prewarm(const mtmm_prewarm_t *profile, size_t n, int flags) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		if (mtmm_reserve(profile[i]._size, profile[i]._count, flags))
+			return -1;
+	return 0;
+}
+
+/*
+ * MTMM_PREWARM="size:count,size:count,..." reserves at load time, so preloaded
+ * programs start warm too; MTMM_PREWARM_POPULATE=1 faults the superblocks in
+ */
+__attribute__((constructor))
+static void prewarmFromEnvironment(void) {
+	const char *profile = getenv("MTMM_PREWARM");
+	const char *populate = getenv("MTMM_PREWARM_POPULATE");
+	int flags = populate && *populate == '1' ? MTMM_RESERVE_POPULATE : 0;
+	size_t size, count;
+	char *end;
+
+	if (!profile)
+		return;
+
+	while (*profile) {
+		size = strtoul(profile, &end, 10);
+		if (*end != ':')
+			break;
+		count = strtoul(end + 1, &end, 10);
+		mtmm_reserve(size, count, flags);
+		if (*end != ',')
+			break;
+		profile = end + 1;
+	}
+}
+
+
+/*********************************************************************************************************/
+
+superblock_t* makeSuperblock(size_t sizeClassBytes) {
+    return makeAlignedSuperblock(sizeClassBytes, MTMM_MIN_ALIGNMENT);
+}
+
+/* make a superblock whose blocks all start at a multiple of alignment */
+superblock_t* makeAlignedSuperblock(size_t sizeClassBytes, size_t alignment) {
 
     /* call system to allocate memory */
-    superblock_t *pSb = (superblock_t*) getCore(SUPERBLOCK_SIZE + sizeof(sblk_metadata_t));
+    superblock_t *pSb = (superblock_t*) getCore(getSuperblockSize(sizeClassBytes, alignment));
 
     if (NULL == pSb) {
         return NULL;
     }
 
+    return formatSuperblock(pSb, sizeClassBytes, alignment);
+}
+
+/* give an empty superblock, already out of every heap, back to the OS */
+void freeSuperblock(superblock_t *pSb) {
+    MTMM_PROBE2(superblock_purge, pSb, pSb->_meta._sizeClassBytes);
+    STATS_ADD(_superblocksPurged, 1);
+    lockDestroy(&(pSb->_meta._sbLock));
+    if (pSb->_meta._inRegion)
+        putRegionSuperblock(pSb);
+    else
+        freeCore(pSb, pSb->_meta._size);
+}
+
+/*
+ * the blocks of a class that fit a superblock of size bytes, with the bytes left
+ * over past the last of them in *tail. Superblocks start at least cache line
+ * aligned, so the layout does not depend on where one is placed.
+ */
+static size_t countBlocks(size_t size, size_t sizeClassBytes, size_t alignment, size_t *tail) {
+    size_t blockOffset = getBlockActualSizeInBytes(sizeClassBytes, alignment);
+    size_t buff = offsetof(superblock_t, _buff);
+    size_t first = ALIGN_UP(buff + sizeof(block_header_t), alignment);
+    size_t blocks;
+
+    if (first + sizeClassBytes > size) {
+        *tail = size;
+        return 0;
+    }
+    blocks = (size - first - sizeClassBytes) / blockOffset + 1;
+    *tail = size - (first + (blocks - 1) * blockOffset + sizeClassBytes);
+    return blocks;
+}
+
+/*
+ * the bytes, metadata included, of the superblocks of a size class: small classes
+ * get smaller ones than SUPERBLOCK_SIZE, so a heap holding a handful of their
+ * blocks does not tie up a whole SUPERBLOCK_SIZE, large ones get bigger ones, so
+ * they hold enough blocks and lose little past the last of them.
+ */
+size_t getSuperblockSize(size_t sizeClassBytes, size_t alignment) {
+    size_t size = SUPERBLOCK_SIZE, tail;
+
+    while (size > SUPERBLOCK_MIN_SIZE &&
+            countBlocks(size / 2, sizeClassBytes, alignment, &tail) >= SUPERBLOCK_TARGET_BLOCKS)
+        size /= 2;
+    while (size < SUPERBLOCK_MAX_SIZE &&
+            (countBlocks(size, sizeClassBytes, alignment, &tail) < SUPERBLOCK_MIN_BLOCKS ||
+             tail > size / SUPERBLOCK_TAIL_WASTE))
+        size *= 2;
+    return size;
+}
+
+/* lay out the blocks of a superblock in memory fresh from core, getSuperblockSize() bytes of it */
+superblock_t* formatSuperblock(superblock_t *pSb, size_t sizeClassBytes, size_t alignment) {
+
+    block_header_t *p, *pPrev = NULL;
+
+    /* the offset in bytes between subsequent blocks, a multiple of alignment */
+    size_t blockOffset = getBlockActualSizeInBytes(sizeClassBytes, alignment);
+
+    /* the first block, its header right before it */
+    uintptr_t first;
+
+    size_t numberOfBlocks;
+    int i;
+
+    first = ALIGN_UP((uintptr_t) pSb->_buff + sizeof(block_header_t), alignment);
+
+    /* the number of blocks that we'll generate in this superblock */
+    pSb->_meta._size = getSuperblockSize(sizeClassBytes, alignment);
+    numberOfBlocks = ((uintptr_t) pSb + pSb->_meta._size - first - sizeClassBytes) / blockOffset + 1;
+
     pSb->_meta._sizeClassBytes = sizeClassBytes;
+    pSb->_meta._alignment = alignment;
     pSb->_meta._NoBlks = pSb->_meta._NoFreeBlks = numberOfBlocks;
+    pSb->_meta._bytesRequested = 0;
     pSb->_meta._pNxtSBlk = pSb->_meta._pPrvSblk = NULL;
+    pSb->_meta._node = 0;
+    pSb->_meta._inRegion = 0;
 
-    /* initialize the working pointer to the address where allocated buffer begins */
-    p = (block_header_t*) pSb->_buff;
+    /* initialize the working pointer to the header of the first block */
+    p = (block_header_t*) first - 1;
 
     /* initialize the stack pointer to the first element in the list
      * it will later be regarded as "top of the stack"
@@ -365,15 +1339,16 @@ superblock_t* makeSuperblock(size_t sizeClassBytes) {
     for (i = 0; i < numberOfBlocks - 1; i++) {
 
         pPrev = p;
-        p += blockOffset;
+        p = (block_header_t*) ((char*) p + blockOffset);
         pPrev->_pNextBlk = p;
         p->_pOwner = pSb;
         p->size = sizeClassBytes;
         p->_pNextBlk = NULL;
     }
 
-    pthread_mutex_init(&(pSb->_meta._sbLock),NULL);
+    lockInit(&(pSb->_meta._sbLock), false);
 
+    MTMM_PROBE2(superblock_create, pSb, sizeClassBytes);
     return pSb;
 }
 
@@ -454,7 +1429,7 @@ void printSuperblock(superblock_t *pSb) {
 /* returns the size in bytes of blocks used in superblock */
 size_t getBytesUsed(const superblock_t *pSb) {
 	size_t usedBlocks = pSb->_meta._NoBlks - pSb->_meta._NoFreeBlks;
-	return usedBlocks * ( getBlockActualSizeInBytes(pSb->_meta._sizeClassBytes));
+	return usedBlocks * ( getBlockActualSizeInBytes(pSb->_meta._sizeClassBytes, pSb->_meta._alignment));
 }
 
 block_header_t *getBlockHeaderForPtr(void *ptr) {
@@ -479,23 +1454,109 @@ void freeBlockFromSuperBlock(superblock_t *pSb, block_header_t *pBlock) {
 		printf("Error freeing memory!\n");
 
 }
-/* the offset between subsequent blocks in units of block_header_t */
-size_t getBlockActualSizeInHeaders(size_t sizeClassBytes){
-	return (sizeClassBytes + 2 * sizeof(block_header_t) - 1)
-			/ sizeof(block_header_t);
+/* the offset between subsequent blocks: the block and its header, keeping blocks aligned */
+size_t getBlockActualSizeInBytes(size_t sizeClassBytes, size_t alignment){
+	return ALIGN_UP(sizeClassBytes + sizeof(block_header_t), alignment);
+}
 
+/*
+ * A large block is a mapping of its own: its header sits right before the aligned
+ * pointer and the mapping runs from the page of the header to the end of the block.
+ * The header has no owner superblock, which is how free tells it from a small block.
+ */
+static void *largeMalloc(size_t sz, size_t alignment) {
+	size_t length;
+	uintptr_t start, end, user, head, tail;
+	block_header_t *pBlock;
+
+	/* room for the header in front and for moving the pointer up to the alignment */
+	length = sizeof(block_header_t) + alignment;
+	if (sz > SIZE_MAX - length - getpagesize())
+		return NULL;
+	length += sz;
+
+	start = (uintptr_t) getCore(length);
+	if (!start) {
+		/* memory allocation failed*/
+		return NULL;
+	}
+	end = PAGE_FLOOR(start + length + getpagesize() - 1);
+
+	user = ALIGN_UP(start + sizeof(block_header_t), alignment);
+	head = PAGE_FLOOR(user - sizeof(block_header_t));
+	tail = PAGE_FLOOR(user + sz + getpagesize() - 1);
+
+	/* give back the pages the alignment skipped over */
+	if (head > start)
+		freeCore((void*) start, head - start);
+	if (end > tail)
+		freeCore((void*) tail, end - tail);
+
+	pBlock = (block_header_t*) user - 1;
+	pBlock->_pNextBlk = NULL;
+	pBlock->_pOwner = NULL;
+	pBlock->size = sz;
+
+	STATS_ADD(_largeAllocations, 1);
+	STATS_ADD(_largeBytesMapped, tail - head);
+
+	if (__atomic_load_n(&softLimit, __ATOMIC_RELAXED))
+		checkMemoryPressure();
+
+	return (void*) user;
 }
 
-size_t getBlockActualSizeInBytes(size_t sizeClassBytes){
-	return getBlockActualSizeInHeaders(sizeClassBytes)*sizeof(block_header_t);
+static void largeFree(block_header_t *pBlock) {
+	uintptr_t head = PAGE_FLOOR((uintptr_t) pBlock);
+	uintptr_t tail = PAGE_FLOOR((uintptr_t) (pBlock + 1) + pBlock->size + getpagesize() - 1);
+
+	if (shmContains(pBlock)) {
+		shmLargeFree(pBlock);
+		return;
+	}
+
+	STATS_ADD(_largeFrees, 1);
+	STATS_SUB(_largeBytesMapped, tail - head);
+	freeCore((void*) head, tail - head);
+}
+
+static bool isLargeBlock(const block_header_t *pBlock) {
+	return pBlock->_pOwner == NULL;
+}
+
+static void _lock_mutex(mtmm_lock_t *mutex, int lockClass, mtmm_lock_site_t site)
+{
+#ifdef MTMM_LOCK_PROFILE
+    struct timespec start, end;
+
+    if (lockTryAcquire(mutex)) {
+        lockProfileRecord(lockClass, site, false, 0);
+        return;
+    }
+
+    /* contended - time the wait */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lockAcquire(mutex);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    lockProfileRecord(lockClass, site, true,
+            (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec);
+#else
+    lockAcquire(mutex);
+#endif
 }
 
-static void _lock_mutex(pthread_mutex_t *mutex)
+/* take the lock only if it is free, accounted like an uncontended _lock_mutex() */
+static bool _trylock_mutex(mtmm_lock_t *mutex, int lockClass, mtmm_lock_site_t site)
 {
-    assert(pthread_mutex_lock(mutex) == 0);
+    if (!lockTryAcquire(mutex))
+        return false;
+#ifdef MTMM_LOCK_PROFILE
+    lockProfileRecord(lockClass, site, false, 0);
+#endif
+    return true;
 }
 
-static void _unlock_mutex(pthread_mutex_t *mutex)
+static void _unlock_mutex(mtmm_lock_t *mutex)
 {
-    assert(pthread_mutex_unlock(mutex) == 0);
+    lockRelease(mutex);
 }
@@ -13,13 +13,37 @@
 
 
 
-size_t getBlockActualSizeInHeaders(size_t sizeClassBytes);
-size_t getBlockActualSizeInBytes(size_t sizeClassBytes);
+size_t getBlockActualSizeInBytes(size_t sizeClassBytes, size_t alignment);
+size_t getSuperblockSize(size_t sizeClassBytes, size_t alignment);
+
+/* a superblock of SUPERBLOCK_SIZE bytes of buffer, as arenas carve theirs */
+#define SUPERBLOCK_BYTES (SUPERBLOCK_SIZE + sizeof(sblk_metadata_t))
 
 void *getCore(size_t size);
+void *getPopulatedCore(size_t size);
+void *getHugeCore(size_t size, size_t alignment, bool hugetlb);
+
+bool hugePagesEnabled(void);
+superblock_t *getRegionSuperblock(int heapIndex, unsigned int node, size_t size);
+void putRegionSuperblock(superblock_t *pSb);
+
+hoard_t *shmHoard(void);
+bool shmContains(const void *p);
+superblock_t *shmGetSuperblock(size_t size);
+void *shmLargeMalloc(size_t sz, size_t alignment);
+void shmLargeFree(block_header_t *pBlock);
+
+void arenaPoolFlush(void);
+
+unsigned int numaNodeCount(void);
+unsigned int numaCurrentNode(void);
+void numaBind(void *p, size_t length, unsigned int node);
 void freeCore(void *p, size_t length);
 
 superblock_t* makeSuperblock(size_t sizeClassBytes);
+superblock_t* makeAlignedSuperblock(size_t sizeClassBytes, size_t alignment);
+superblock_t* formatSuperblock(superblock_t *pSb, size_t sizeClassBytes, size_t alignment);
+void freeSuperblock(superblock_t *pSb);
 block_header_t *popBlock(superblock_t *pSb);
 superblock_t *pushBlock(superblock_t *pSb, block_header_t *pBlk);
 unsigned short getFullness(superblock_t *pSb);
@@ -32,7 +56,12 @@ void removeSuperblockFromHeap(cpuheap_t *heap, int sizeClass_ix, superblock_t *p
 void addSuperblockToHeap(cpuheap_t *heap, int sizeClass_ix, superblock_t *pSb);
 void *allocateBlockFromCurrentHeap( superblock_t *pSb);
 void freeBlockFromCurrentHeap( block_header_t *pBlock);
+size_t allocateBlocksFromCurrentHeap(superblock_t *pSb, void **ptrs, size_t n);
+void freeBlocksFromCurrentHeap(superblock_t *pSb, void **ptrs, size_t n);
 bool isHeapUnderUtilized(cpuheap_t *pHeap);
+extern size_t hoardK;
+extern double hoardEmptyFraction;
+extern size_t hoardMaxSlack;
 
 superblock_t *findMostlyEmptySuperblock(cpuheap_t *pHeap);
 
@@ -42,6 +71,7 @@ superblock_t *findAvailableSuperblock(size_class_t *sizeClass);
 void printSizeClass(size_class_t *sizeClass);
 
 size_t getSizeClassIndex(size_t size);
+size_t getAlignedSizeClassIndex(size_t size, size_t alignment);
 size_class_t *getSizeClassForSuperblock(superblock_t *pSb);
 void *allocateFromSuperblock(superblock_t *pSb);
 
@@ -9,15 +9,138 @@
 #include <stddef.h>
 #include <pthread.h>
 
+#ifdef __cplusplus
+/* the libc allocator prototypes are noexcept in C++, ours must match them */
+#define MTMM_NOTHROW noexcept
+extern "C" {
+#else
+#define MTMM_NOTHROW
+#endif
+
+
+/*
+ * policy: every definition down to MTMM_LOCK_TYPE may be given on the command line
+ * (-DNUMBER_OF_HEAPS=8 ...) to build a variant of the library, see VARIANTS in the
+ * Makefile. A program must be built with the same definitions as the library it
+ * links, as they size the structures below.
+ */
 
 // The minimum allocation grain for a given object
+#ifndef SUPERBLOCK_SIZE
 #define SUPERBLOCK_SIZE 65536
+#endif
+/* each size class has superblocks of its own size, see getSuperblockSize(): from
+ * SUPERBLOCK_SIZE halved while they would still hold SUPERBLOCK_TARGET_BLOCKS blocks,
+ * then doubled while they hold fewer than SUPERBLOCK_MIN_BLOCKS or lose more than
+ * 1/SUPERBLOCK_TAIL_WASTE of their bytes past the last block
+ */
+#ifndef SUPERBLOCK_MIN_SIZE
+#define SUPERBLOCK_MIN_SIZE 16384
+#endif
+#ifndef SUPERBLOCK_MAX_SIZE
+#define SUPERBLOCK_MAX_SIZE 262144
+#endif
+#ifndef SUPERBLOCK_TARGET_BLOCKS
+#define SUPERBLOCK_TARGET_BLOCKS 512
+#endif
+#ifndef SUPERBLOCK_MIN_BLOCKS
+#define SUPERBLOCK_MIN_BLOCKS 4
+#endif
+#ifndef SUPERBLOCK_TAIL_WASTE
+#define SUPERBLOCK_TAIL_WASTE 8
+#endif
+#ifndef NUMBER_OF_HEAPS
 #define NUMBER_OF_HEAPS 2
-#define GEREAL_HEAP_IX 0
+#endif
+#ifndef HOARD_K
 #define HOARD_K 0
+#endif
+#ifndef HOARD_EMPTY_FRACTION
 #define HOARD_EMPTY_FRACTION 0.25
+#endif
+/* adaptive migration, see mtmm_set_adaptive_migration(): a heap's slack is bytes it
+ * keeps free on top of K superblocks, up to HOARD_MAX_SLACK, and each SUPERBLOCK_SIZE
+ * of it adds HOARD_F_STEP to f (K + 8 superblocks, f 0.75 with the defaults)
+ */
+#ifndef HOARD_MAX_SLACK
+#define HOARD_MAX_SLACK (8 * SUPERBLOCK_SIZE)
+#endif
+#ifndef HOARD_F_STEP
+#define HOARD_F_STEP 0.0625
+#endif
+/* the heap and superblock locks: plain pthread mutexes, glibc's adaptive ones,
+ * which spin a while before they sleep, or the allocator's own (see lock.h), which
+ * spin up to MTMM_LOCK_SPINS pauses with exponential backoff before they sleep on a
+ * futex, and in the fair flavour are taken in the order they were asked for. Fair
+ * locks hand over to a sleeping thread with a context switch, which costs dearly
+ * once there are more threads than CPUs.
+ */
+#define MTMM_LOCK_PTHREAD 0
+#define MTMM_LOCK_PTHREAD_ADAPTIVE 1
+#define MTMM_LOCK_SPIN_FUTEX 2
+#define MTMM_LOCK_SPIN_FUTEX_FAIR 3
+#ifndef MTMM_LOCK_TYPE
+#define MTMM_LOCK_TYPE MTMM_LOCK_SPIN_FUTEX
+#endif
+#ifndef MTMM_LOCK_SPINS
+#define MTMM_LOCK_SPINS 1024
+#endif
+
+#define GEREAL_HEAP_IX 0
+/* the global heap is split per NUMA node: node 0's is GEREAL_HEAP_IX, those of
+ * nodes 1.. follow the private heaps, which are spread over the nodes
+ */
+#define MTMM_MAX_NUMA_NODES 4
+#define NUMBER_OF_ALL_HEAPS (NUMBER_OF_HEAPS + MTMM_MAX_NUMA_NODES)
+#define GLOBAL_HEAP_IX(node) ((node) ? NUMBER_OF_HEAPS + (node) : GEREAL_HEAP_IX)
+#define IS_GLOBAL_HEAP_IX(i) ((i) == GEREAL_HEAP_IX || (i) > NUMBER_OF_HEAPS)
+/* powers of two up to 32768, the largest block SUPERBLOCK_SIZE / 2 may allow */
 #define NUMBER_OF_SIZE_CLASSES 16
 
+#if SUPERBLOCK_SIZE / 2 > (1 << (NUMBER_OF_SIZE_CLASSES - 1))
+#error "SUPERBLOCK_SIZE / 2 is larger than the largest size class"
+#endif
+#if SUPERBLOCK_MIN_SIZE > SUPERBLOCK_SIZE || SUPERBLOCK_SIZE > SUPERBLOCK_MAX_SIZE
+#error "SUPERBLOCK_SIZE must lie between SUPERBLOCK_MIN_SIZE and SUPERBLOCK_MAX_SIZE"
+#endif
+#if (SUPERBLOCK_SIZE & (SUPERBLOCK_SIZE - 1)) || (SUPERBLOCK_MIN_SIZE & (SUPERBLOCK_MIN_SIZE - 1)) || \
+	(SUPERBLOCK_MAX_SIZE & (SUPERBLOCK_MAX_SIZE - 1)) || SUPERBLOCK_MIN_SIZE < 4096
+#error "superblock sizes must be powers of two of at least a page"
+#endif
+#if SUPERBLOCK_MAX_SIZE > (1 << 21)
+#error "SUPERBLOCK_MAX_SIZE must fit a 2MB huge page region"
+#endif
+#if NUMBER_OF_HEAPS < 1
+#error "NUMBER_OF_HEAPS must be at least 1"
+#endif
+
+#if MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD || MTMM_LOCK_TYPE == MTMM_LOCK_PTHREAD_ADAPTIVE
+typedef pthread_mutex_t mtmm_lock_t;
+#else
+typedef struct {
+	/* 0 free, 1 held, 2 held and maybe slept on; the next ticket when fair */
+	unsigned int _state;
+	/* fair only: the ticket being served, and the threads asleep waiting for theirs */
+	unsigned int _serving, _sleepers;
+	/* non zero for a lock in shared memory, whose futex is not process private */
+	unsigned int _shared;
+} mtmm_lock_t;
+#endif
+
+/* every block is aligned to this, as malloc must be for any type */
+#define MTMM_MIN_ALIGNMENT 16
+/* superblocks are laid out for alignments MTMM_MIN_ALIGNMENT, twice that, ... up to
+ * MTMM_MAX_CLASS_ALIGNMENT; larger alignments are served from their own mapping
+ */
+#define MTMM_MAX_CLASS_ALIGNMENT 64
+#define NUMBER_OF_ALIGNMENT_CLASSES 3
+#define NUMBER_OF_SIZE_CLASS_LISTS (NUMBER_OF_SIZE_CLASSES * NUMBER_OF_ALIGNMENT_CLASSES)
+
+/* a heap indexes its superblocks, all size classes together, by the sixty-fourth
+ * of their blocks in use, so its emptiest superblock is found in constant time
+ */
+#define FULLNESS_BUCKETS 64
+
 /*
 
 The malloc() function allocates size bytes and returns a pointer to the allocated memory. 
@@ -45,7 +168,7 @@ pointer value that can later be successfully passed to free().
  17. Unlock heap i.
  18. Return a block from the superblock.
 */
-void * malloc (size_t sz);
+void * malloc (size_t sz) MTMM_NOTHROW;
 
 
 /*
@@ -70,7 +193,7 @@ free (ptr)
  12. 	a 0 ← a 0 + S, a i ← a i − S
  13. Unlock heap i and the superblock.
 */
-void free (void * ptr) ;
+void free (void * ptr) MTMM_NOTHROW;
 
 
 /*
@@ -88,13 +211,242 @@ call to malloc(), calloc() or realloc(). If the area pointed to was moved, a fre
 2. copy from old location to a new one
 3. free old allocation
 */
-void * realloc (void * ptr, size_t sz) ;
+void * realloc (void * ptr, size_t sz) MTMM_NOTHROW;
+
+/*
+ * realloc of nmemb elements of size bytes, failing with ENOMEM when the
+ * product overflows
+ */
+void *reallocarray(void *ptr, size_t nmemb, size_t size) MTMM_NOTHROW;
 
 
 /*
  * allocates and zeros the allocated memory
  */
-void *calloc(size_t nmemb, size_t size);
+void *calloc(size_t nmemb, size_t size) MTMM_NOTHROW;
+
+
+/*
+ * aligned allocation, freed with free().
+ * Alignments up to MTMM_MAX_CLASS_ALIGNMENT are served from superblocks laid out
+ * for that alignment, so they cost no more space than malloc of the same size.
+ * Larger alignments get a mapping of their own trimmed to the aligned block.
+ * posix_memalign() returns EINVAL unless alignment is a power of two multiple of
+ * sizeof(void *), aligned_alloc() fails with EINVAL unless it is a power of two,
+ * and memalign() rounds it up to one. valloc() and pvalloc() align to the page,
+ * pvalloc() also rounds the size up to whole pages.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size) MTMM_NOTHROW;
+void *aligned_alloc(size_t alignment, size_t size) MTMM_NOTHROW;
+void *memalign(size_t alignment, size_t size) MTMM_NOTHROW;
+void *valloc(size_t size) MTMM_NOTHROW;
+void *pvalloc(size_t size) MTMM_NOTHROW;
+
+
+/*
+ * malloc_usable_size() returns how many bytes can be used at ptr, which may be
+ * more than were asked for; the slack is the block's own and can be grown into.
+ * free_sized() and free_aligned_sized() free ptr like free() but trust the size
+ * (and alignment) it was allocated with to pick the small or large path. The
+ * size must be the one asked for or any size up to malloc_usable_size(ptr);
+ * memory from the aligned entry points must be freed with free_aligned_sized().
+ */
+size_t malloc_usable_size(void *ptr) MTMM_NOTHROW;
+void free_sized(void *ptr, size_t size) MTMM_NOTHROW;
+void free_aligned_sized(void *ptr, size_t alignment, size_t size) MTMM_NOTHROW;
+
+
+/*
+ * batch allocation for objects handled in groups.
+ * mtmm_malloc_batch() allocates n objects of sz bytes into ptrs and returns how
+ * many it got (fewer than n only when memory ran out). The heap lock is taken
+ * once and every superblock used gives all the blocks it can at once.
+ * mtmm_free_batch() frees n pointers (NULLs allowed) that may come from any
+ * mix of heaps and sizes. Each owner heap is locked once, each superblock is
+ * relinked once. The order of the ptrs array is changed.
+ */
+size_t mtmm_malloc_batch(size_t sz, size_t n, void **ptrs);
+void mtmm_free_batch(void **ptrs, size_t n);
+
+
+/*
+ * arenas for request scoped allocation.
+ * mtmm_arena_alloc() bumps a pointer through whole superblocks: objects have no
+ * header, are 16 byte aligned, and are never freed one by one. mtmm_arena_reset()
+ * releases everything allocated from the arena at once, handing its superblocks
+ * back as one chain. mtmm_arena_destroy() also releases the arena itself.
+ * An arena must not be used by two threads at the same time, and its objects
+ * must not be passed to free().
+ */
+typedef struct mtmm_arena mtmm_arena_t;
+
+mtmm_arena_t *mtmm_arena_create(void);
+void *mtmm_arena_alloc(mtmm_arena_t *arena, size_t size);
+void mtmm_arena_reset(mtmm_arena_t *arena);
+void mtmm_arena_destroy(mtmm_arena_t *arena);
+
+/*
+ * typed object caches for hot fixed size structs.
+ * mtmm_cache_create() makes a cache of objects of exactly size bytes aligned to
+ * align (0 for pointer alignment, otherwise a power of two); it returns NULL with
+ * errno set if the arguments are invalid or all caches are taken. Objects are
+ * packed into dedicated superblocks without headers. ctor runs once per object
+ * when its superblock is made, not on every mtmm_cache_alloc(), so a freed object
+ * must be returned in its constructed state. dtor runs on every object when the
+ * cache is destroyed; all objects must have been freed by then. Objects must only
+ * be freed to their own cache, never with free().
+ */
+typedef struct mtmm_cache mtmm_cache_t;
+
+typedef struct {
+	const char *_name;
+	size_t _objectSize, _stride;
+	unsigned long long _slabs, _objects;
+	/* objects on the cache's free list, not counting per-thread magazines */
+	unsigned long long _objectsFree;
+	/* allocations served from a thread's magazine, and refills from the cache */
+	unsigned long long _magazineHits, _magazineMisses;
+} mtmm_cache_stats_t;
+
+mtmm_cache_t *mtmm_cache_create(const char *name, size_t size, size_t align,
+				void (*ctor)(void *), void (*dtor)(void *));
+void *mtmm_cache_alloc(mtmm_cache_t *cache);
+void mtmm_cache_free(mtmm_cache_t *cache, void *object);
+void mtmm_cache_destroy(mtmm_cache_t *cache);
+void mtmm_cache_stats(mtmm_cache_t *cache, mtmm_cache_stats_t *stats);
+
+
+/*
+ * pre-warming, to take superblock creation and page faults off the first requests.
+ * mtmm_reserve() makes sure every private heap has at least count free blocks of
+ * the size class of size (at most S/2), making superblocks outside the heap locks.
+ * With MTMM_RESERVE_POPULATE their pages are faulted in as well. mtmm_prewarm()
+ * reserves every entry of a profile. Both return 0, or -1 with errno set (EINVAL,
+ * ENOMEM). The same can be asked for without code changes through the environment:
+ * MTMM_PREWARM="64:10000,256:2000" and MTMM_PREWARM_POPULATE=1.
+ * Reserved superblocks that stay empty may still be handed on to the global heap,
+ * where they remain ready to be adopted.
+ */
+#define MTMM_RESERVE_POPULATE 1
+
+typedef struct {
+	size_t _size;
+	size_t _count;
+} mtmm_prewarm_t;
+
+int mtmm_reserve(size_t size, size_t count, int flags);
+int mtmm_prewarm(const mtmm_prewarm_t *profile, size_t n, int flags);
+
+
+/*
+ * NUMA placement. Private heaps are spread over the nodes that have CPUs (as many
+ * as there are private heaps, MTMM_MAX_NUMA_NODES at most), and a thread uses a
+ * heap of the node it is running on. Superblocks are bound to their heap's node
+ * with mbind(MPOL_PREFERRED) before they are first touched, go back to their own
+ * node's global heap when donated, and are only adopted from another node's
+ * global heap under memory pressure or when no new superblock can be mapped.
+ * The topology is read from sysfs at load time. mtmm_set_numa_topology() (or
+ * MTMM_NUMA_TOPOLOGY at load time) replaces it with the CPU lists of the nodes
+ * separated by '/', e.g. "0-3,8-11/4-7,12-15", node i being the kernel's node i;
+ * NULL or "" reads sysfs again. It is best called before allocating. It returns
+ * 0, or -1 with errno EINVAL for a malformed topology. With a single node the
+ * allocator behaves as if it knew nothing of NUMA.
+ */
+int mtmm_set_numa_topology(const char *topology);
+
+
+/*
+ * adaptive heap assignment, off by default. When on, a thread sticks to the heap it
+ * was hashed to and only trylocks it in malloc. A thread that keeps finding its
+ * heap taken moves to the least contended heap of its NUMA node; per heap and per
+ * thread contention counts decay, so the assignment settles once load calms down.
+ * The heaps are the same NUMBER_OF_HEAPS as in the default mode.
+ * MTMM_ADAPTIVE_HEAPS=1 turns it on at load time.
+ */
+void mtmm_set_adaptive_heaps(int enable);
+
+
+/*
+ * adaptive migration between the private heaps and the global heap, on by
+ * default. A heap counts a bounce when a superblock of a size class moves back
+ * within a short while of one of the same class moving the other way - donated
+ * on a free, then adopted or made again on the next mallocs, or the reverse. Each
+ * bounce raises the heap's slack by the bytes of the superblock that bounced (see
+ * HOARD_MAX_SLACK), so it keeps more empty space before donating; a heap that goes
+ * without a bounce for long enough steps back down by SUPERBLOCK_SIZE. Every heap
+ * still holds at most HOARD_MAX_SLACK bytes on top of K superblocks, and a fraction
+ * HOARD_MAX_SLACK / SUPERBLOCK_SIZE * HOARD_F_STEP more of its memory free, beyond
+ * what Hoard's fixed policy allows. The slack is ignored while over the soft limit.
+ * Off, K and f are the fixed HOARD_K and HOARD_EMPTY_FRACTION.
+ * MTMM_ADAPTIVE_MIGRATION=0 turns it off at load time.
+ */
+void mtmm_set_adaptive_migration(int enable);
+
+
+/*
+ * huge page backing, off by default. With MTMM_HUGE_PAGES_THP superblocks are
+ * carved from 2MB aligned regions advised with MADV_HUGEPAGE, so a region is
+ * backed by one transparent huge page; MTMM_HUGE_PAGES_HUGETLB maps regions with
+ * MAP_HUGETLB and falls back to the former when no huge pages are reserved.
+ * Superblocks made for the same heap share regions, all size classes. A region is
+ * given back to the OS only when all of its superblocks are, so purging under a
+ * soft limit frees memory a whole region at a time. mtmm_set_huge_pages() affects
+ * superblocks made after it; it returns -1 with errno EINVAL for an unknown mode.
+ * MTMM_HUGE_PAGES=thp or MTMM_HUGE_PAGES=hugetlb picks a mode at load time.
+ */
+#define MTMM_HUGE_PAGES_OFF 0
+#define MTMM_HUGE_PAGES_THP 1
+#define MTMM_HUGE_PAGES_HUGETLB 2
+
+int mtmm_set_huge_pages(int mode);
+
+
+/*
+ * shared memory heaps. mtmm_shm_attach() maps the POSIX shared memory object name
+ * (e.g. "/workers") at address in the calling process, creating it with size bytes
+ * if it does not exist yet. Every cooperating process must attach the same name at
+ * the same address, so pointers into the segment mean the same in all of them.
+ * The segment holds a hoard of its own, with process shared locks, and
+ * mtmm_shm_malloc() allocates from it; free() and realloc() accept blocks of the
+ * segment from any attached process, so an object graph built by one process can
+ * be handed to another without copying. Blocks larger than half a superblock take
+ * whole pages of the segment. Memory of the segment is never given back to the OS
+ * before it is unlinked, and a process that dies holding one of its locks leaves
+ * the segment unusable. A process attaches at most one segment: mtmm_shm_attach()
+ * returns -1 with errno EBUSY if one is attached, EINVAL for a size or address that
+ * is not page aligned or for an existing object that is not a segment, or that its
+ * creator did not format within a couple of seconds, or the errno of the failed
+ * shm_open/mmap. A creator that fails after sizing the object unlinks it.
+ * mtmm_shm_detach() unmaps it; blocks in it must not be touched afterwards.
+ */
+int mtmm_shm_attach(const char *name, void *address, size_t size);
+void mtmm_shm_detach(void);
+void *mtmm_shm_malloc(size_t size);
+
+
+/*
+ * writes out the calling thread's buffered allocation trace records.
+ * Does nothing unless the library is built with MTMM_TRACE (libmtmm-trace.a),
+ * in which case buffers are also flushed on thread exit and process exit.
+ */
+void mtmm_trace_flush(void);
+
+
+/*
+ * sampling heap profiler, active only when the library is built with
+ * MTMM_HEAP_PROFILE (libmtmm-heapprof.a); otherwise the dump functions fail
+ * with ENOSYS.
+ *
+ * On average one allocation per sampling interval of bytes (512KB by default,
+ * or $MTMM_HEAP_PROFILE_RATE) is sampled with its stack. A rate of 0 stops
+ * sampling. mtmm_heap_profile_dump() writes the live samples to fd in the pprof
+ * legacy heap format, e.g. for "pprof --text prog heap.prof".
+ * mtmm_heap_profile_dump_on_signal() installs a handler that dumps to path
+ * whenever signum is delivered.
+ */
+void mtmm_heap_profile_set_rate(size_t bytes);
+int mtmm_heap_profile_dump(int fd);
+int mtmm_heap_profile_dump_on_signal(int signum, const char *path);
 
 
 
@@ -122,14 +474,46 @@ typedef struct  {
 	 */
 	size_t _sizeClassBytes;
 
+	/*
+	 * alignment of every block in the superblock
+	 */
+	size_t _alignment;
+
+	/*
+	 * bytes asked for by the blocks in use, kept in their headers' size
+	 */
+	size_t _bytesRequested;
+
+	/*
+	 * bytes the superblock takes, this metadata included
+	 */
+	size_t _size;
+
 	/* Doubly linked list pointers*/
 	struct superblock *_pNxtSBlk, *_pPrvSblk;
 
+	/*
+	 * the owner heap's fullness bucket the superblock is in, the range of used
+	 * block counts that keeps it there, and the bucket's list
+	 */
+	unsigned int _fullnessBucket, _bucketFloor, _bucketCeiling;
+	struct superblock *_pNxtByFullness, *_pPrvByFullness;
+
 	/*
 	 * pointer to the owner heap
 	 */
 	struct cpuheap *_pOwnerHeap;
 
+	/*
+	 * NUMA node the superblock was placed on
+	 */
+	unsigned int _node;
+
+	/*
+	 * non zero if the superblock was carved from a huge page region
+	 */
+	unsigned int _inRegion;
+
 	/*
 	 * LIFO stack of free blocks
 	 */
@@ -138,7 +522,7 @@ typedef struct  {
 	/*
 	 * lock to prevent race conditions while updating the metadata
 	 */
-	pthread_mutex_t _sbLock;
+	mtmm_lock_t _sbLock;
 
 } sblk_metadata_t;
 
@@ -149,9 +533,9 @@ typedef struct superblock {
 
 	sblk_metadata_t _meta;
 	/*
-	 * actual allocated memory
+	 * actual allocated memory, _meta._size bytes less the metadata
 	 */
-	char _buff[SUPERBLOCK_SIZE];
+	char _buff[];
 
 } superblock_t;
 
@@ -187,16 +571,61 @@ typedef struct  {
 
 
 
+/* event counters of a heap
+ * updated under the heap lock, so they cost a plain increment
+ */
+typedef struct {
+	/* heap lock acquisitions, plus the superblock locks taken on the way */
+	unsigned long long _lockAcquisitions;
+
+	/* superblocks made from core for this heap */
+	unsigned long long _superblocksCreated;
+
+	/* superblocks moved in from the global heap, and out to it */
+	unsigned long long _superblocksAdopted, _superblocksDonated;
+
+	/* of the adopted superblocks, those placed on another NUMA node */
+	unsigned long long _superblocksAdoptedRemote;
+
+	/* threads that moved to this heap to get away from contention */
+	unsigned long long _threadsMovedIn;
+
+	/* superblocks of a size class moved back shortly after moving the other way */
+	unsigned long long _migrationBounces;
+
+} heap_counters_t;
+
+
 /* per CPU memory allocations struct
  * should be allocated in data segment
  */
 typedef struct cpuheap{
-	unsigned short _CpuId;
-
 	/* u(i) and a(i) from hoard*/
 	size_t _bytesUsed, _bytesAvailable;
 
-	size_class_t _sizeClasses[NUMBER_OF_SIZE_CLASSES];
+	/* the list of size class i and alignment class a is at a * NUMBER_OF_SIZE_CLASSES + i */
+	size_class_t _sizeClasses[NUMBER_OF_SIZE_CLASS_LISTS];
+
+	/* every superblock of the heap by fullness bucket, and the buckets in use */
+	struct superblock *_byFullness[FULLNESS_BUCKETS];
+	unsigned long long _fullnessMask;
+
+	heap_counters_t _counters;
+
+	/* bytes of slack added by the adaptive migration policy, and the lock
+	   acquisition count (the heap's clock) when it last changed */
+	size_t _slack;
+	unsigned long long _slackChangedAt;
+
+	/* the clock when a superblock of each list last moved out, and in */
+	unsigned long long _donatedAt[NUMBER_OF_SIZE_CLASS_LISTS];
+	unsigned long long _adoptedAt[NUMBER_OF_SIZE_CLASS_LISTS];
+
+	/* taken to use the heap, process shared for the heaps of a shared segment */
+	mtmm_lock_t _lock;
+
+	/* the hoard the heap belongs to */
+	struct hoard *_pHoard;
 
 } cpuheap_t;
 
@@ -205,12 +634,233 @@ typedef struct cpuheap{
 /* top level memory allocator struct
  * should be allocated in data segment
  */
-typedef struct {
-	cpuheap_t _heaps[NUMBER_OF_HEAPS+1];
+typedef struct hoard {
+	cpuheap_t _heaps[NUMBER_OF_ALL_HEAPS];
+
+	/* set for the hoard inside a shared memory segment, see mtmm_shm_attach() */
+	unsigned int _shared;
 
 } hoard_t;
 
 
+
+/* snapshot of one heap, see mtmm_stats() */
+typedef struct {
+	size_t _bytesUsed, _bytesAvailable;
+
+	/* the NUMA node the heap's superblocks are placed on */
+	unsigned int _node;
+
+	/* bytes of slack the adaptive migration policy added */
+	size_t _slack;
+
+	/* number of superblocks in each size class */
+	unsigned int _superblocks[NUMBER_OF_SIZE_CLASSES];
+
+	heap_counters_t _counters;
+
+} mtmm_heap_stats_t;
+
+/* allocator wide snapshot, see mtmm_stats() */
+typedef struct {
+	/* heap 0 is the global heap of node 0, GLOBAL_HEAP_IX(n) that of node n */
+	mtmm_heap_stats_t _heaps[NUMBER_OF_ALL_HEAPS];
+
+	/* NUMA nodes the private heaps are spread over */
+	unsigned int _numaNodes;
+
+	/* superblocks moved between private heaps and the global heap */
+	unsigned long long _migrations;
+
+	/* allocations larger than S/2, mapped directly from core */
+	unsigned long long _largeAllocations, _largeFrees, _largeBytesMapped;
+
+	/* calls to the operating system */
+	unsigned long long _mmapCalls, _munmapCalls;
+
+	/* everything mapped from core, in pages, the figure the soft limit is held to */
+	unsigned long long _coreBytesMapped;
+
+	/* empty superblocks given back to the OS under memory pressure */
+	unsigned long long _superblocksPurged;
+
+	/* heap and superblock lock acquisitions, all heaps */
+	unsigned long long _lockAcquisitions;
+
+} mtmm_stats_t;
+
+
+/*
+ * mtmm_stats() fills a snapshot of the runtime statistics, taking each heap lock
+ * in turn so every heap's figures are consistent. It is cheap enough to be polled.
+ *
+ * mtmm_stats_json() writes the same snapshot as a JSON object into buffer without
+ * allocating. Like snprintf it returns the length the full output needs, so a result
+ * >= length means the output was truncated.
+ */
+void mtmm_stats(mtmm_stats_t *stats);
+int mtmm_stats_json(char *buffer, size_t length);
+
+
+/* one superblock as the heap walker sees it, see mtmm_heap_walk() */
+typedef struct {
+	const void *_address;
+
+	/* the heap it is in, and the NUMA node it was placed on */
+	unsigned int _heap, _node;
+
+	size_t _sizeClassBytes, _alignment;
+
+	/* the bytes each block takes, its header and alignment padding included */
+	size_t _blockBytes;
+
+	unsigned int _blocks, _freeBlocks;
+
+	/* bytes asked for by the blocks in use */
+	size_t _bytesRequested;
+
+	/* bytes the superblock takes, its metadata included */
+	size_t _bytes;
+
+} mtmm_superblock_info_t;
+
+typedef void (*mtmm_heap_walk_callback_t)(const mtmm_superblock_info_t *info, void *arg);
+
+/*
+ * mtmm_heap_walk() calls callback for every superblock of every heap of the
+ * process, the global heaps included. Each heap is walked under its lock, which
+ * is what every change to its superblocks takes, so a heap is seen as one
+ * consistent snapshot; different heaps are seen at different moments. The
+ * callback runs with that lock held and must not allocate or free. Block
+ * contents are never read.
+ */
+void mtmm_heap_walk(mtmm_heap_walk_callback_t callback, void *arg);
+
+
+/*
+ * superblocks by the fraction of their blocks in use: bin 0 holds the empty ones,
+ * bin i those more than (i - 1) / 4 and at most i / 4 full
+ */
+#define MTMM_FULLNESS_BINS 5
+
+/* fragmentation of one size class, aligned superblocks counted with their size */
+typedef struct {
+	unsigned int _fullness[MTMM_FULLNESS_BINS];
+
+	size_t _blocksUsed, _blocksFree;
+
+	/* bytes asked for by the blocks in use */
+	size_t _bytesRequested;
+
+	/* what the blocks in use take beyond what was asked for: size class
+	   rounding, headers and alignment padding */
+	size_t _internalWaste;
+
+	/* free blocks in superblocks that are not empty, which cannot go back to
+	   the OS or serve another size class */
+	size_t _externalWaste;
+
+} mtmm_class_fragmentation_t;
+
+typedef struct {
+	mtmm_class_fragmentation_t _classes[NUMBER_OF_SIZE_CLASSES];
+
+	/* superblocks in all heaps, and their bytes, metadata included */
+	unsigned int _superblocks;
+	size_t _superblockBytes;
+
+	/* totals of the per class figures */
+	size_t _bytesRequested, _internalWaste, _externalWaste;
+
+	/* superblock space no block fits in, and the metadata */
+	size_t _overhead;
+
+	/* superblocks held by the global heaps, out of reach of the threads until
+	   adopted, and the bytes of blocks still in use in them */
+	size_t _strandedBytes, _strandedBytesUsed;
+
+} mtmm_fragmentation_t;
+
+/*
+ * mtmm_fragmentation() aggregates a heap walk into fragmentation figures.
+ * mtmm_fragmentation_report() formats them into buffer as a compact text report,
+ * one line of totals and one line per size class in use, without allocating.
+ * Like snprintf it returns the length the full report needs.
+ */
+void mtmm_fragmentation(mtmm_fragmentation_t *report);
+int mtmm_fragmentation_report(char *buffer, size_t length);
+
+
+/*
+ * soft memory limit. When an allocation takes the memory mapped from core (see
+ * _coreBytesMapped) above bytes, the allocator purges: empty superblocks of the
+ * global heap and the arena superblock pool go back to the OS, and private heaps
+ * donate with lowered K and f thresholds, returning superblocks that are empty
+ * straight to the OS. If the limit is still exceeded afterwards, the callback
+ * runs on the allocating thread with no allocator lock held, so it may allocate
+ * and free. It runs again only once the footprint has grown further. The lowered
+ * thresholds stay until the footprint drops below 7/8 of the limit.
+ * A limit of 0 (the default) turns this off.
+ */
+typedef void (*mtmm_pressure_callback_t)(size_t footprint, size_t limit, void *arg);
+
+void mtmm_set_soft_limit(size_t bytes);
+void mtmm_set_pressure_callback(mtmm_pressure_callback_t callback, void *arg);
+
+
+
+/* call sites that take allocator locks */
+typedef enum {
+	/* heap i lock at the start of malloc */
+	MTMM_LOCK_SITE_MALLOC,
+	/* global heap and superblock locks while adopting a superblock */
+	MTMM_LOCK_SITE_MALLOC_SLOW_PATH,
+	/* superblock and owner heap locks at the start of free */
+	MTMM_LOCK_SITE_FREE,
+	/* relocking after the superblock moved to another heap */
+	MTMM_LOCK_SITE_FREE_RETRY,
+	/* global heap and superblock locks while donating a superblock */
+	MTMM_LOCK_SITE_FREE_MIGRATION,
+	/* statistics and other introspection */
+	MTMM_LOCK_SITE_OTHER,
+	MTMM_LOCK_SITES
+} mtmm_lock_site_t;
+
+/* lock classes are heap indexes (see IS_GLOBAL_HEAP_IX) plus all superblock locks */
+#define MTMM_LOCK_CLASS_SUPERBLOCK NUMBER_OF_ALL_HEAPS
+#define MTMM_LOCK_CLASSES (NUMBER_OF_ALL_HEAPS + 1)
+
+typedef struct {
+	unsigned long long _acquisitions;
+
+	/* acquisitions that found the lock taken, and the time they waited */
+	unsigned long long _contended, _waitNs;
+
+} mtmm_lock_counters_t;
+
+typedef struct {
+	mtmm_lock_counters_t _counters[MTMM_LOCK_CLASSES][MTMM_LOCK_SITES];
+} mtmm_lock_stats_t;
+
+/*
+ * lock contention profile, collected only when the library is built with
+ * MTMM_LOCK_PROFILE (libmtmm-lockprof.a); otherwise all counters read 0.
+ * Every lock is first tried, and acquisitions that have to wait are counted
+ * and timed per lock class and call site.
+ *
+ * mtmm_lock_stats() copies the counters. mtmm_lock_stats_report() writes a
+ * table of the contended (class, site) pairs, worst total wait first, with
+ * snprintf semantics and without allocating. The profiled library also writes
+ * this report to stderr at exit.
+ */
+void mtmm_lock_stats(mtmm_lock_stats_t *stats);
+int mtmm_lock_stats_report(char *buffer, size_t length);
+
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 
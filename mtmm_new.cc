@@ -0,0 +1,141 @@
+/*
+ *
+ *      This module replaces the global operator new and delete with the Hoard
+ *      heaps. It is built on its own into libmtmm-new.a so a program opts in by
+ *      linking it; the sized and aligned overloads go straight to the sized and
+ *      aligned entry points.
+ */
+
+#include <cstddef>
+#include <new>
+
+#include "mtmm.h"
+
+/* operator new semantics: retry through the new handler, throw when there is none */
+static void *allocate(std::size_t size, std::size_t alignment)
+{
+    void *p;
+
+    for (;;) {
+        p = alignment <= MTMM_MIN_ALIGNMENT ? malloc(size ? size : 1)
+                                            : aligned_alloc(alignment, size ? size : 1);
+        if (p != nullptr) {
+            return p;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+static void *allocate_nothrow(std::size_t size, std::size_t alignment) noexcept
+{
+    try {
+        return allocate(size, alignment);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void *operator new(std::size_t size)
+{
+    return allocate(size, MTMM_MIN_ALIGNMENT);
+}
+
+void *operator new[](std::size_t size)
+{
+    return allocate(size, MTMM_MIN_ALIGNMENT);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, MTMM_MIN_ALIGNMENT);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, MTMM_MIN_ALIGNMENT);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, std::size_t size) noexcept
+{
+    free_sized(p, size);
+}
+
+void operator delete[](void *p, std::size_t size) noexcept
+{
+    free_sized(p, size);
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, std::size_t size, std::align_val_t alignment) noexcept
+{
+    free_aligned_sized(p, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[](void *p, std::size_t size, std::align_val_t alignment) noexcept
+{
+    free_aligned_sized(p, static_cast<std::size_t>(alignment), size);
+}
@@ -0,0 +1,47 @@
+/*
+ *
+ *      This module implements mtmm::heap_resource, see mtmm_pmr.h
+ */
+
+#include <new>
+
+#include "mtmm.h"
+#include "mtmm_pmr.h"
+
+namespace mtmm {
+
+void *heap_resource::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+    void *p;
+
+    if (alignment <= MTMM_MIN_ALIGNMENT) {
+        p = malloc(bytes);
+    } else {
+        p = aligned_alloc(alignment, bytes);
+    }
+
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void heap_resource::do_deallocate(void *p, std::size_t bytes, std::size_t alignment)
+{
+    free_aligned_sized(p, alignment, bytes);
+}
+
+bool heap_resource::do_is_equal(const std::pmr::memory_resource &other) const noexcept
+{
+    return dynamic_cast<const heap_resource *>(&other) != nullptr;
+}
+
+heap_resource *get_heap_resource() noexcept
+{
+    /* never destroyed, so it outlives containers in other static objects */
+    static heap_resource *resource = new (malloc(sizeof(heap_resource))) heap_resource();
+
+    return resource;
+}
+
+}
@@ -0,0 +1,37 @@
+/*
+ * mtmm_pmr.h
+ *
+ *      C++ access to the allocator without replacing the global malloc: a
+ *      std::pmr::memory_resource backed by the Hoard heaps.
+ *
+ *      The global operator new/delete replacements are in libmtmm-new.a; link it
+ *      ahead of the C++ runtime to route every new/delete through the heaps.
+ */
+
+#ifndef __MTMM_PMR_H__
+#define __MTMM_PMR_H__
+
+#include <cstddef>
+#include <memory_resource>
+
+namespace mtmm {
+
+/*
+ * memory resource on the Hoard heaps. Alignments up to MTMM_MAX_CLASS_ALIGNMENT
+ * come from superblocks, and deallocation goes through the sized free path with
+ * the size the container passes back. All instances share the same heaps, so
+ * any of them can free memory of another.
+ */
+class heap_resource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void *p, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override;
+};
+
+/* the process wide heap_resource, e.g. for std::pmr::set_default_resource() */
+heap_resource *get_heap_resource() noexcept;
+
+}
+
+#endif /* __MTMM_PMR_H__ */
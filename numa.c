@@ -0,0 +1,199 @@
+/*
+ *
+ *      This module knows the NUMA topology - which node each CPU is on, read from
+ *      sysfs or given by the user - and places memory on a node with mbind.
+ *      Nodes are numbered densely from 0 here; only nodes that have CPUs count,
+ *      and the kernel's own node ids are used for nothing but binding.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "memory_allocator.h"
+
+/* CPUs past this are taken to be on node 0 */
+#define MAX_CPUS 1024
+
+/* kernel node ids that fit in one mbind mask word */
+#define MAX_KERNEL_NODES (8 * sizeof(unsigned long))
+
+/* from <numaif.h>, which needs libnuma's headers */
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+
+#define SYSFS_NODES "/sys/devices/system/node"
+
+/* a single node until a topology is set, so early allocations take today's path */
+static unsigned int nodeCount = 1;
+static unsigned char cpuNode[MAX_CPUS];
+static unsigned int kernelNode[MTMM_MAX_NUMA_NODES];
+
+
+unsigned int numaNodeCount(void)
+{
+    return __atomic_load_n(&nodeCount, __ATOMIC_RELAXED);
+}
+
+/* the node of the CPU the calling thread runs on, which may change right after */
+unsigned int numaCurrentNode(void)
+{
+    int cpu = sched_getcpu();
+
+    return cpu >= 0 && cpu < MAX_CPUS ? cpuNode[cpu] : 0;
+}
+
+/*
+ * prefer node for the pages of [p, p + length), p page aligned. Pages already
+ * faulted in are moved. Failing is harmless, the memory stays where the kernel
+ * puts it, so errors (e.g. for a node that only exists in an overridden
+ * topology) are ignored.
+ */
+void numaBind(void *p, size_t length, unsigned int node)
+{
+    unsigned long mask;
+
+    if (node >= numaNodeCount())
+        return;
+
+    mask = 1UL << kernelNode[node];
+    syscall(SYS_mbind, p, length, MPOL_PREFERRED, &mask, MAX_KERNEL_NODES + 1, MPOL_MF_MOVE);
+}
+
+/*
+ * parse a list like "0-3,8-11", setting map[i] = value for every i in it below
+ * mapSize. Returns where the list ends, or NULL if it is malformed.
+ */
+static const char *parseList(const char *list, unsigned char *map, size_t mapSize, unsigned char value)
+{
+    unsigned long first, last;
+    char *end;
+
+    for (;;) {
+        if (*list < '0' || *list > '9')
+            return NULL;
+        first = last = strtoul(list, &end, 10);
+        if (*end == '-') {
+            if (end[1] < '0' || end[1] > '9')
+                return NULL;
+            last = strtoul(end + 1, &end, 10);
+        }
+        if (last < first)
+            return NULL;
+
+        for (; first <= last && first < mapSize; first++)
+            map[first] = value;
+
+        if (*end != ',')
+            return end;
+        list = end + 1;
+    }
+}
+
+/* read a sysfs file into buffer without allocating, false if it is not there */
+static bool readSysfs(const char *path, char *buffer, size_t length)
+{
+    int fd = open(path, O_RDONLY);
+    ssize_t n;
+
+    if (fd == -1)
+        return false;
+    n = read(fd, buffer, length - 1);
+    close(fd);
+    if (n <= 0)
+        return false;
+    buffer[n] = '\0';
+    return true;
+}
+
+/* fill cpus and kernel ids from sysfs, returns the number of nodes with CPUs */
+static unsigned int readSystemTopology(unsigned char *cpus, unsigned int *kernelIds)
+{
+    unsigned char hasCpu[MAX_KERNEL_NODES];
+    char path[64], buffer[4096];
+    unsigned int id, nodes = 0;
+
+    memset(hasCpu, 0, sizeof(hasCpu));
+    if (!readSysfs(SYSFS_NODES "/has_cpu", buffer, sizeof(buffer)) ||
+            !parseList(buffer, hasCpu, MAX_KERNEL_NODES, 1))
+        return 1;
+
+    for (id = 0; id < MAX_KERNEL_NODES && nodes < MTMM_MAX_NUMA_NODES; id++) {
+        if (!hasCpu[id])
+            continue;
+        snprintf(path, sizeof(path), SYSFS_NODES "/node%u/cpulist", id);
+        if (!readSysfs(path, buffer, sizeof(buffer)) || !parseList(buffer, cpus, MAX_CPUS, nodes))
+            continue;
+        kernelIds[nodes++] = id;
+    }
+
+    return nodes ? nodes : 1;
+}
+
+/* "0-3/4-7": the CPU list of every node, node i taken to be kernel node i */
+static unsigned int parseTopology(const char *topology, unsigned char *cpus, unsigned int *kernelIds)
+{
+    unsigned int nodes = 0;
+
+    for (;;) {
+        if (nodes == MTMM_MAX_NUMA_NODES)
+            return 0;
+        topology = parseList(topology, cpus, MAX_CPUS, nodes);
+        if (!topology)
+            return 0;
+        kernelIds[nodes] = nodes;
+        nodes++;
+
+        if (*topology == '\0')
+            return nodes;
+        if (*topology != '/')
+            return 0;
+        topology++;
+    }
+}
+
+int mtmm_set_numa_topology(const char *topology)
+{
+    unsigned char cpus[MAX_CPUS];
+    unsigned int kernelIds[MTMM_MAX_NUMA_NODES] = { 0 };
+    unsigned int nodes, i;
+
+    memset(cpus, 0, sizeof(cpus));
+    if (topology && *topology) {
+        nodes = parseTopology(topology, cpus, kernelIds);
+        if (!nodes) {
+            errno = EINVAL;
+            return -1;
+        }
+    } else {
+        nodes = readSystemTopology(cpus, kernelIds);
+    }
+
+    /* every node needs a private heap of its own, the ones past that share */
+    if (nodes > NUMBER_OF_HEAPS)
+        nodes = NUMBER_OF_HEAPS;
+    for (i = 0; i < MAX_CPUS; i++)
+        cpus[i] %= nodes;
+
+    memcpy(cpuNode, cpus, sizeof(cpuNode));
+    memcpy(kernelNode, kernelIds, sizeof(kernelNode));
+    __atomic_store_n(&nodeCount, nodes, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * MTMM_NUMA_TOPOLOGY overrides what sysfs says, "0-1023" turns placement off.
+ * Runs ahead of the other constructors, so superblocks they reserve are placed.
+ */
+__attribute__((constructor(101)))
+static void numaFromEnvironment(void)
+{
+    mtmm_set_numa_topology(getenv("MTMM_NUMA_TOPOLOGY"));
+}
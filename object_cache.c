@@ -0,0 +1,325 @@
+/*
+ *
+ *      This module implements typed object caches (kmem_cache style). A cache owns
+ *      slabs of superblock size cut into objects of exactly its own stride, instead
+ *      of rounding them up to a power of two size class. Objects are constructed once
+ *      when their slab is made and keep their state across free and alloc.
+ *
+ *      Free objects are kept on a cache wide list (the depot) linked through a word
+ *      of the object - its first word when there is no constructor, or a word after
+ *      the object when there is one, so constructed state is never overwritten.
+ *      Each thread keeps a small magazine of objects per cache in front of the depot,
+ *      so the common alloc/free takes no lock.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory_allocator.h"
+#include "assert_static.h"
+
+#define MAX_CACHES 32
+#define MAGAZINE_SIZE 16
+
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((uintptr_t) (a) - 1))
+
+/* slabs are linked through a header at their start */
+typedef struct slab {
+    struct slab *_pNext;
+} slab_t;
+
+struct mtmm_cache {
+    char _name[32];
+    size_t _size, _align, _stride;
+
+    /* offset of the free list link inside an object's stride */
+    size_t _linkOffset;
+    unsigned int _objectsPerSlab;
+
+    void (*_ctor)(void *);
+    void (*_dtor)(void *);
+
+    /* bumped on create and destroy, so magazines of a destroyed cache are dropped */
+    unsigned int _generation;
+    bool _inUse, _lockInit;
+
+    pthread_mutex_t _lock;
+    slab_t *_pSlabs;
+    void *_pDepot;
+    unsigned long long _slabs, _depotLength;
+    unsigned long long _magazineHits, _magazineMisses;
+};
+
+typedef struct {
+    unsigned int _generation;
+    unsigned int _count;
+    unsigned long long _hits;
+    void *_objects[MAGAZINE_SIZE];
+} magazine_t;
+
+static struct mtmm_cache caches[MAX_CACHES];
+static pthread_mutex_t cachesLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t magazineKeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t magazineKey;
+
+static __thread magazine_t threadMagazines[MAX_CACHES];
+static __thread bool threadRegistered;
+
+static void **_link(mtmm_cache_t *cache, void *object)
+{
+    return (void **) ((char *) object + cache->_linkOffset);
+}
+
+/* cut a new slab into constructed objects on the depot, cache locked */
+static bool _grow(mtmm_cache_t *cache)
+{
+    slab_t *pSlab = getCore(SUPERBLOCK_SIZE);
+    char *object = NULL;
+    unsigned int i;
+
+    if (pSlab == NULL) {
+        return false;
+    }
+    pSlab->_pNext = cache->_pSlabs;
+    cache->_pSlabs = pSlab;
+    cache->_slabs++;
+
+    object = (char *) ALIGN_UP((uintptr_t) (pSlab + 1), cache->_align);
+    for (i = 0; i < cache->_objectsPerSlab; i++, object += cache->_stride) {
+        if (cache->_ctor != NULL) {
+            cache->_ctor(object);
+        }
+        *_link(cache, object) = cache->_pDepot;
+        cache->_pDepot = object;
+    }
+    cache->_depotLength += cache->_objectsPerSlab;
+
+    return true;
+}
+
+/* give the depot up to count objects from a magazine, cache locked */
+static void _flush(mtmm_cache_t *cache, magazine_t *magazine, unsigned int count)
+{
+    void *object = NULL;
+
+    while (count-- > 0 && magazine->_count > 0) {
+        object = magazine->_objects[--magazine->_count];
+        *_link(cache, object) = cache->_pDepot;
+        cache->_pDepot = object;
+        cache->_depotLength++;
+    }
+    cache->_magazineHits += magazine->_hits;
+    magazine->_hits = 0;
+}
+
+/* thread exit - hand every magazine back to its cache */
+static void _thread_exit(void *unused)
+{
+    unsigned int i;
+
+    for (i = 0; i < MAX_CACHES; i++) {
+        /* an alloc-only thread has an empty magazine but hits to fold in */
+        if (threadMagazines[i]._count == 0 && threadMagazines[i]._hits == 0) {
+            continue;
+        }
+        assert(pthread_mutex_lock(&caches[i]._lock) == 0);
+        if (caches[i]._inUse && caches[i]._generation == threadMagazines[i]._generation) {
+            _flush(&caches[i], &threadMagazines[i], MAGAZINE_SIZE);
+        }
+        threadMagazines[i]._count = 0;
+        threadMagazines[i]._hits = 0;
+        assert(pthread_mutex_unlock(&caches[i]._lock) == 0);
+    }
+}
+
+static void _create_key(void)
+{
+    assert(pthread_key_create(&magazineKey, _thread_exit) == 0);
+}
+
+static magazine_t *_magazine(mtmm_cache_t *cache)
+{
+    magazine_t *magazine = &threadMagazines[cache - caches];
+
+    if (magazine->_generation != cache->_generation) {
+        /* first use, or left over from a destroyed cache in this slot */
+        magazine->_generation = cache->_generation;
+        magazine->_count = 0;
+        magazine->_hits = 0;
+
+        if (!threadRegistered) {
+            pthread_once(&magazineKeyOnce, _create_key);
+            pthread_setspecific(magazineKey, threadMagazines);
+            threadRegistered = true;
+        }
+    }
+    return magazine;
+}
+
+mtmm_cache_t *mtmm_cache_create(const char *name, size_t size, size_t align,
+                                void (*ctor)(void *), void (*dtor)(void *))
+{
+    mtmm_cache_t *cache = NULL;
+    unsigned int i;
+
+    if (align == 0) {
+        align = sizeof(void *);
+    }
+    if ((align & (align - 1)) != 0 || align > SUPERBLOCK_SIZE / 4 || size == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    assert(pthread_mutex_lock(&cachesLock) == 0);
+    for (i = 0; i < MAX_CACHES && cache == NULL; i++) {
+        if (!caches[i]._inUse) {
+            cache = &caches[i];
+            cache->_inUse = true;
+        }
+    }
+    assert(pthread_mutex_unlock(&cachesLock) == 0);
+
+    if (cache == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    strncpy(cache->_name, name ? name : "", sizeof(cache->_name) - 1);
+    cache->_name[sizeof(cache->_name) - 1] = '\0';
+    cache->_size = size;
+    cache->_align = align;
+    cache->_ctor = ctor;
+    cache->_dtor = dtor;
+
+    if (ctor != NULL) {
+        /* the link goes after the object so it never overwrites constructed state */
+        cache->_linkOffset = ALIGN_UP(size, sizeof(void *));
+        cache->_stride = ALIGN_UP(cache->_linkOffset + sizeof(void *), align);
+    } else {
+        cache->_linkOffset = 0;
+        cache->_stride = ALIGN_UP(size < sizeof(void *) ? sizeof(void *) : size, align);
+    }
+    cache->_objectsPerSlab =
+        (SUPERBLOCK_SIZE - (ALIGN_UP(sizeof(slab_t), align))) / cache->_stride;
+
+    if (cache->_objectsPerSlab == 0) {
+        cache->_inUse = false;
+        errno = EINVAL;
+        return NULL;
+    }
+
+    cache->_pSlabs = NULL;
+    cache->_pDepot = NULL;
+    cache->_slabs = cache->_depotLength = 0;
+    cache->_magazineHits = cache->_magazineMisses = 0;
+    if (!cache->_lockInit) {
+        /* never destroyed, exiting threads may still lock a dead slot */
+        pthread_mutex_init(&cache->_lock, NULL);
+        cache->_lockInit = true;
+    }
+    __atomic_add_fetch(&cache->_generation, 1, __ATOMIC_RELEASE);
+
+    return cache;
+}
+
+void *mtmm_cache_alloc(mtmm_cache_t *cache)
+{
+    magazine_t *magazine = _magazine(cache);
+    void *object = NULL;
+
+    if (magazine->_count > 0) {
+        magazine->_hits++;
+        return magazine->_objects[--magazine->_count];
+    }
+
+    /* empty magazine - load half of it from the depot */
+    assert(pthread_mutex_lock(&cache->_lock) == 0);
+    cache->_magazineMisses++;
+    cache->_magazineHits += magazine->_hits;
+    magazine->_hits = 0;
+    while (magazine->_count < MAGAZINE_SIZE / 2) {
+        if (cache->_pDepot == NULL && !_grow(cache)) {
+            break;
+        }
+        object = cache->_pDepot;
+        cache->_pDepot = *_link(cache, object);
+        cache->_depotLength--;
+        magazine->_objects[magazine->_count++] = object;
+    }
+    assert(pthread_mutex_unlock(&cache->_lock) == 0);
+
+    if (magazine->_count == 0) {
+        return NULL;
+    }
+    return magazine->_objects[--magazine->_count];
+}
+
+void mtmm_cache_free(mtmm_cache_t *cache, void *object)
+{
+    magazine_t *magazine = _magazine(cache);
+
+    if (object == NULL) {
+        return;
+    }
+
+    if (magazine->_count == MAGAZINE_SIZE) {
+        /* full magazine - give half of it to the depot */
+        assert(pthread_mutex_lock(&cache->_lock) == 0);
+        _flush(cache, magazine, MAGAZINE_SIZE / 2);
+        assert(pthread_mutex_unlock(&cache->_lock) == 0);
+    }
+    magazine->_objects[magazine->_count++] = object;
+}
+
+void mtmm_cache_destroy(mtmm_cache_t *cache)
+{
+    slab_t *pSlab = NULL, *pNext = NULL;
+    char *object = NULL;
+    unsigned int i;
+
+    assert(pthread_mutex_lock(&cache->_lock) == 0);
+    /* magazines of every thread are dropped from now on */
+    __atomic_add_fetch(&cache->_generation, 1, __ATOMIC_RELEASE);
+
+    for (pSlab = cache->_pSlabs; pSlab != NULL; pSlab = pNext) {
+        pNext = pSlab->_pNext;
+        if (cache->_dtor != NULL) {
+            object = (char *) ALIGN_UP((uintptr_t) (pSlab + 1), cache->_align);
+            for (i = 0; i < cache->_objectsPerSlab; i++, object += cache->_stride) {
+                cache->_dtor(object);
+            }
+        }
+        freeCore(pSlab, SUPERBLOCK_SIZE);
+    }
+    cache->_pSlabs = NULL;
+    cache->_pDepot = NULL;
+    assert(pthread_mutex_unlock(&cache->_lock) == 0);
+
+    assert(pthread_mutex_lock(&cachesLock) == 0);
+    cache->_inUse = false;
+    assert(pthread_mutex_unlock(&cachesLock) == 0);
+}
+
+void mtmm_cache_stats(mtmm_cache_t *cache, mtmm_cache_stats_t *stats)
+{
+    magazine_t *magazine = _magazine(cache);
+
+    assert(pthread_mutex_lock(&cache->_lock) == 0);
+    /* fold in the calling thread's hits; other threads fold theirs in when they
+       refill or flush their magazine, and when they exit */
+    cache->_magazineHits += magazine->_hits;
+    magazine->_hits = 0;
+
+    stats->_name = cache->_name;
+    stats->_objectSize = cache->_size;
+    stats->_stride = cache->_stride;
+    stats->_slabs = cache->_slabs;
+    stats->_objects = cache->_slabs * cache->_objectsPerSlab;
+    stats->_objectsFree = cache->_depotLength;
+    stats->_magazineHits = cache->_magazineHits;
+    stats->_magazineMisses = cache->_magazineMisses;
+    assert(pthread_mutex_unlock(&cache->_lock) == 0);
+}
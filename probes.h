@@ -0,0 +1,46 @@
+/*
+ * probes.h
+ *
+ *      Static tracepoints at the allocator slow path events, for bpftrace/perf:
+ *
+ *        bpftrace -e 'usdt:./prog:mtmm:superblock_donate { @[arg1] = count(); }'
+ *
+ *      With <sys/sdt.h> available (systemtap-sdt-dev) each probe is a single nop
+ *      plus an ELF note describing its arguments, so unattached probes cost nothing.
+ *      Without it, or with MTMM_NO_USDT defined, the probes compile away.
+ *
+ *      Probes and their arguments:
+ *        superblock_create(superblock, size class bytes)
+ *        superblock_adopt(superblock, heap)     - moved from the global heap to heap
+ *        superblock_donate(superblock, heap)    - moved from heap to the global heap
+ *        superblock_purge(superblock, size class bytes) - empty, given back to the OS
+ *        memory_pressure(footprint, limit)      - soft limit exceeded, purging
+ *        core_map(address, length)              - mmap in getCore()
+ *        core_unmap(address, length)            - munmap in freeCore()
+ *        free_lock_retry(superblock, old heap, new heap)
+ */
+
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#if !defined(MTMM_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define MTMM_USDT
+#endif
+#endif
+
+#ifdef MTMM_USDT
+
+#include <sys/sdt.h>
+
+#define MTMM_PROBE2(name, a, b) DTRACE_PROBE2(mtmm, name, a, b)
+#define MTMM_PROBE3(name, a, b, c) DTRACE_PROBE3(mtmm, name, a, b, c)
+
+#else /* Not MTMM_USDT */
+
+#define MTMM_PROBE2(name, a, b)
+#define MTMM_PROBE3(name, a, b, c)
+
+#endif /* MTMM_USDT */
+
+#endif /* __PROBES_H__ */
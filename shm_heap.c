@@ -0,0 +1,327 @@
+/*
+ *
+ *      This module keeps the shared memory segment of mtmm_shm_attach(): a POSIX
+ *      shared memory object mapped at the same address in every process that
+ *      attaches it, holding a hoard_t with process shared locks and the pages its
+ *      superblocks and large blocks are carved from. Pointers in the segment are
+ *      plain pointers, valid in all of the processes.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "memory_allocator.h"
+#include "lock.h"
+
+/* Linux 4.17, older kernels take it as a hint and the address is checked below */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+#define SHM_MAGIC 0x6d746d6d73686d31ULL
+#define SHM_PAGE 4096UL
+#define SHM_PAGE_CEIL(x) (((x) + SHM_PAGE - 1) & ~(SHM_PAGE - 1))
+#define SHM_PAGE_FLOOR(x) ((x) & ~(SHM_PAGE - 1))
+
+/* a run of free pages, the header lives in its first page */
+typedef struct shm_run {
+    struct shm_run *_next;
+    size_t _length;
+} shm_run_t;
+
+typedef struct {
+    unsigned long long _magic;
+    size_t _size;
+
+    /* set by the creator once everything below is initialised */
+    unsigned int _ready;
+
+    /* guards _freeRuns, innermost of all locks */
+    pthread_mutex_t _runLock;
+    /* free runs of pages, in address order so neighbours coalesce */
+    shm_run_t *_freeRuns;
+
+    hoard_t _hoard;
+} shm_segment_t;
+
+#define FIRST_RUN SHM_PAGE_CEIL(sizeof(shm_segment_t))
+
+/* seconds an attacher waits for the creator to size and format the segment */
+#define SHM_ATTACH_TIMEOUT 2
+
+static shm_segment_t *segment;
+
+
+hoard_t *shmHoard(void)
+{
+    shm_segment_t *seg = __atomic_load_n(&segment, __ATOMIC_ACQUIRE);
+
+    return seg ? &seg->_hoard : NULL;
+}
+
+bool shmContains(const void *p)
+{
+    shm_segment_t *seg = __atomic_load_n(&segment, __ATOMIC_ACQUIRE);
+
+    return seg && (uintptr_t) p >= (uintptr_t) seg && (uintptr_t) p < (uintptr_t) seg + seg->_size;
+}
+
+/* make mutex usable from every process the segment is mapped in */
+static void shmInitLock(pthread_mutex_t *mutex)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* first fit, returns length bytes of pages or NULL when no run is long enough */
+static void *takeRun(size_t length)
+{
+    shm_run_t **link, *run, *rest;
+
+    pthread_mutex_lock(&segment->_runLock);
+    for (link = &segment->_freeRuns; (run = *link); link = &run->_next) {
+        if (run->_length < length)
+            continue;
+        if (run->_length == length) {
+            *link = run->_next;
+        } else {
+            rest = (shm_run_t*) ((char*) run + length);
+            rest->_next = run->_next;
+            rest->_length = run->_length - length;
+            *link = rest;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&segment->_runLock);
+    return run;
+}
+
+/* give back pages from takeRun(), merged with the free runs next to them */
+static void giveRun(void *p, size_t length)
+{
+    shm_run_t **link, *prev = NULL, *run = p;
+
+    pthread_mutex_lock(&segment->_runLock);
+    for (link = &segment->_freeRuns; *link && *link < run; link = &(*link)->_next)
+        prev = *link;
+
+    run->_length = length;
+    run->_next = *link;
+    if (run->_next && (char*) run + run->_length == (char*) run->_next) {
+        run->_length += run->_next->_length;
+        run->_next = run->_next->_next;
+    }
+    if (prev && (char*) prev + prev->_length == (char*) run) {
+        prev->_length += run->_length;
+        prev->_next = run->_next;
+    } else {
+        *link = run;
+    }
+    pthread_mutex_unlock(&segment->_runLock);
+}
+
+/* size bytes for a superblock of the shared hoard, unformatted; superblocks stay in the segment */
+superblock_t *shmGetSuperblock(size_t size)
+{
+    return takeRun(SHM_PAGE_CEIL(size));
+}
+
+/*
+ * a large block in the segment, laid out like one from largeMalloc(): the run of
+ * its pages starts at the page of its header and ends at the page of its last
+ * byte, so shmLargeFree() finds the run from the header alone. _pNextBlk is left
+ * NULL, as for every live block.
+ */
+void *shmLargeMalloc(size_t sz, size_t alignment)
+{
+    size_t length;
+    uintptr_t start, user, first, end;
+    block_header_t *pBlock;
+
+    length = sizeof(block_header_t) + alignment;
+    if (sz > SIZE_MAX - length - SHM_PAGE)
+        return NULL;
+    length = SHM_PAGE_CEIL(length + sz);
+
+    start = (uintptr_t) takeRun(length);
+    if (!start)
+        return NULL;
+
+    user = (start + sizeof(block_header_t) + alignment - 1) & ~((uintptr_t) alignment - 1);
+    pBlock = (block_header_t*) user - 1;
+
+    /* give back the pages the alignment did not need, at either end */
+    first = SHM_PAGE_FLOOR((uintptr_t) pBlock);
+    end = SHM_PAGE_CEIL(user + sz);
+    if (first > start)
+        giveRun((void*) start, first - start);
+    if (start + length > end)
+        giveRun((void*) end, start + length - end);
+
+    pBlock->_pNextBlk = NULL;
+    pBlock->_pOwner = NULL;
+    pBlock->size = sz;
+    return (void*) user;
+}
+
+void shmLargeFree(block_header_t *pBlock)
+{
+    uintptr_t first = SHM_PAGE_FLOOR((uintptr_t) pBlock);
+
+    giveRun((void*) first, SHM_PAGE_CEIL((uintptr_t) (pBlock + 1) + pBlock->size) - first);
+}
+
+/* initialise a segment fresh from ftruncate, which reads as zeroes */
+static void formatSegment(shm_segment_t *seg, size_t size)
+{
+    int i;
+
+    seg->_magic = SHM_MAGIC;
+    seg->_size = size;
+    shmInitLock(&seg->_runLock);
+
+    seg->_freeRuns = (shm_run_t*) ((char*) seg + FIRST_RUN);
+    seg->_freeRuns->_next = NULL;
+    seg->_freeRuns->_length = size - FIRST_RUN;
+
+    for (i = 0; i < NUMBER_OF_ALL_HEAPS; i++) {
+        lockInit(&seg->_hoard._heaps[i]._lock, true);
+        seg->_hoard._heaps[i]._pHoard = &seg->_hoard;
+    }
+    seg->_hoard._shared = 1;
+
+    __atomic_store_n(&seg->_ready, 1, __ATOMIC_RELEASE);
+}
+
+/* whether SHM_ATTACH_TIMEOUT has passed since start, for an attacher waiting on the creator */
+static bool attachTimedOut(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - start->tv_sec > SHM_ATTACH_TIMEOUT ||
+        (now.tv_sec - start->tv_sec == SHM_ATTACH_TIMEOUT && now.tv_nsec >= start->tv_nsec);
+}
+
+int mtmm_shm_attach(const char *name, void *address, size_t size)
+{
+    shm_segment_t *seg;
+    struct timespec start;
+    struct stat st;
+    bool creator;
+    int fd, error;
+
+    if (__atomic_load_n(&segment, __ATOMIC_ACQUIRE)) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (!address || (uintptr_t) address % SHM_PAGE || size % SHM_PAGE ||
+            size < FIRST_RUN + SHM_PAGE_CEIL(SUPERBLOCK_BYTES)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    creator = fd != -1;
+    if (!creator) {
+        if (errno != EEXIST)
+            return -1;
+        fd = shm_open(name, O_RDWR, 0);
+        if (fd == -1)
+            return -1;
+    }
+
+    if (creator) {
+        if (ftruncate(fd, size) == -1) {
+            close(fd);
+            shm_unlink(name);
+            return -1;
+        }
+    } else {
+        /* the creator may not have sized it yet, the segment's own size is used */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (;;) {
+            if (fstat(fd, &st) == -1) {
+                close(fd);
+                return -1;
+            }
+            if (st.st_size)
+                break;
+            if (attachTimedOut(&start)) {
+                close(fd);
+                errno = EINVAL;
+                return -1;
+            }
+            sched_yield();
+        }
+        size = st.st_size;
+        /* too small to hold our header, or not ours at all */
+        if (size % SHM_PAGE || size < FIRST_RUN + SHM_PAGE_CEIL(SUPERBLOCK_BYTES)) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    seg = mmap(address, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    close(fd);
+    if (seg != MAP_FAILED && seg != address) {
+        munmap(seg, size);
+        seg = MAP_FAILED;
+        errno = EEXIST;
+    }
+    if (seg == MAP_FAILED) {
+        /* sized but never formatted, it would only make later attachers wait */
+        if (creator) {
+            error = errno;
+            shm_unlink(name);
+            errno = error;
+        }
+        return -1;
+    }
+
+    if (creator) {
+        formatSegment(seg, size);
+    } else {
+        /* a creator that failed after sizing it, or a segment that is not ours,
+           never becomes ready */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        while (!__atomic_load_n(&seg->_ready, __ATOMIC_ACQUIRE)) {
+            if (attachTimedOut(&start)) {
+                munmap(seg, size);
+                errno = EINVAL;
+                return -1;
+            }
+            sched_yield();
+        }
+        if (seg->_magic != SHM_MAGIC || seg->_size != size) {
+            munmap(seg, size);
+            errno = EINVAL;
+            return -1;
+        }
+    }
+
+    __atomic_store_n(&segment, seg, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void mtmm_shm_detach(void)
+{
+    shm_segment_t *seg = __atomic_exchange_n(&segment, NULL, __ATOMIC_ACQ_REL);
+
+    if (seg)
+        munmap(seg, seg->_size);
+}
@@ -54,6 +54,11 @@ void removeSuperBlock(size_class_t *sizeClass, superblock_t *superBlock) {
         previous->_meta._pNxtSBlk = next;
         next->_meta._pPrvSblk = previous;
 
+        /* the head moves on to the next superblock, which is the next fullest */
+        if (sizeClass->_SBlkList._first == superBlock) {
+            sizeClass->_SBlkList._first = next;
+        }
+
         superBlock->_meta._pPrvSblk = NULL;
         superBlock->_meta._pNxtSBlk = NULL;
     }
@@ -65,6 +70,7 @@ void removeSuperBlock(size_class_t *sizeClass, superblock_t *superBlock) {
  */
 void insertSuperBlock(size_class_t *sizeClass, superblock_t *superBlock) {
     superblock_t * place_before = NULL;
+    unsigned short fullness = 0;
 
     if (sizeClass->_SBlkList._first == NULL) {
         assert(sizeClass->_SBlkList._length == 0);
@@ -72,10 +78,17 @@ void insertSuperBlock(size_class_t *sizeClass, superblock_t *superBlock) {
         return;
     }
 
-    place_before = find_least_full_than(sizeClass, getFullness(superBlock));
+    fullness = getFullness(superBlock);
+    place_before = find_least_full_than(sizeClass, fullness);
     assert(place_before != NULL);
     place_superblock(superBlock, place_before);
     sizeClass->_SBlkList._length++;
+
+    /* placing before the head puts the superblock at the tail of the circular
+       list, unless it is at least as full as the head - then it is the new head */
+    if (place_before == sizeClass->_SBlkList._first && fullness >= getFullness(place_before)) {
+        sizeClass->_SBlkList._first = superBlock;
+    }
 }
 
 /* find available superblock */
@@ -135,6 +148,42 @@ void freeBlockFromCurrentSizeClass(size_class_t *sizeClass, superblock_t *superB
     relocateSuperBlockAhead(sizeClass, superBlock);
 }
 
+/* pop up to n blocks into ptrs (as user pointers) with a single relocation */
+size_t allocateBlocksFromSizeClass(size_class_t *sizeClass, superblock_t *superBlock, void **ptrs, size_t n)
+{
+    block_header_t *block = NULL;
+    size_t count = 0;
+
+    for (count = 0; count < n; count++) {
+        block = popBlock(superBlock);
+        if (block == NULL) {
+            break;
+        }
+        ptrs[count] = ((void *) block) + sizeof(block_header_t);
+    }
+
+    if (count > 0) {
+        relocateSuperBlockBack(sizeClass, superBlock);
+    }
+
+    return count;
+}
+
+/* push n blocks of the same superblock (given as user pointers) with a single relocation */
+void freeBlocksFromCurrentSizeClass(size_class_t *sizeClass, superblock_t *superBlock, void **ptrs, size_t n)
+{
+    block_header_t *block = NULL;
+    size_t i = 0;
+
+    for (i = 0; i < n; i++) {
+        block = getBlockHeaderForPtr(ptrs[i]);
+        assert(block->_pOwner == superBlock);
+        pushBlock(superBlock, block);
+    }
+
+    relocateSuperBlockAhead(sizeClass, superBlock);
+}
+
 void printSizeClass(size_class_t *sizeClass){
     int i;
     superblock_t *p=sizeClass->_SBlkList._first;
@@ -157,9 +206,20 @@ size_t getSizeClassIndex(size_t size){
 
 }
 
+/* index of the superblock list for blocks of size bytes aligned to alignment */
+size_t getAlignedSizeClassIndex(size_t size, size_t alignment){
+    size_t alignmentClass = 0;
+
+    while ((MTMM_MIN_ALIGNMENT << alignmentClass) < alignment)
+        alignmentClass++;
+    assert(alignmentClass < NUMBER_OF_ALIGNMENT_CLASSES);
+
+    return alignmentClass * NUMBER_OF_SIZE_CLASSES + getSizeClassIndex(size);
+}
+
 size_class_t *getSizeClassForSuperblock(superblock_t *pSb){
 
-    size_t i=getSizeClassIndex(pSb->_meta._sizeClassBytes);
+    size_t i=getAlignedSizeClassIndex(pSb->_meta._sizeClassBytes, pSb->_meta._alignment);
     return &(pSb->_meta._pOwnerHeap->_sizeClasses[i]);
 }
 
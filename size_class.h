@@ -7,6 +7,8 @@ void insertSuperBlock(size_class_t *sizeClass, superblock_t *superBlock);
 superblock_t * findMostlyEmptySuperblockSizeClass(size_class_t *sizeClass);
 void *allocateBlockFromSizeClass(size_class_t *sizeClass, superblock_t *superBlock);
 void freeBlockFromCurrentSizeClass(size_class_t *sizeClass, superblock_t *superBlock, block_header_t *block);
+size_t allocateBlocksFromSizeClass(size_class_t *sizeClass, superblock_t *superBlock, void **ptrs, size_t n);
+void freeBlocksFromCurrentSizeClass(size_class_t *sizeClass, superblock_t *superBlock, void **ptrs, size_t n);
 
 size_t size_class_used_bytes(size_class_t *sizeClass);
 
@@ -0,0 +1,140 @@
+/*
+ *
+ *      This module keeps the allocator wide counters and formats statistics
+ *      snapshots. Formatting writes into the caller's buffer and never allocates,
+ *      so it can be called from a metrics exporter running inside the process.
+ *      The fragmentation report is aggregated from a heap walk the same way.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "mtmm.h"
+#include "stats.h"
+
+core_counters_t coreCounters;
+
+/* snprintf into what is left of the buffer, always accounting the full length */
+void statsAppend(char *buffer, size_t length, int *written, const char *format, ...)
+{
+    va_list args;
+    size_t offset = *written;
+    int n;
+
+    va_start(args, format);
+    n = vsnprintf(offset < length ? buffer + offset : NULL,
+                  offset < length ? length - offset : 0, format, args);
+    va_end(args);
+
+    if (n > 0) {
+        *written += n;
+    }
+}
+
+int mtmm_stats_json(char *buffer, size_t length)
+{
+    mtmm_stats_t stats;
+    mtmm_heap_stats_t *heap = NULL;
+    int written = 0;
+    unsigned int i, j;
+
+    mtmm_stats(&stats);
+
+    statsAppend(buffer, length, &written, "{\"numa_nodes\":%u,\"heaps\":[", stats._numaNodes);
+    for (i = 0; i < NUMBER_OF_ALL_HEAPS; i++) {
+        heap = &stats._heaps[i];
+        statsAppend(buffer, length, &written,
+                "%s{\"id\":%u,\"node\":%u,\"bytes_used\":%zu,\"bytes_available\":%zu,"
+                "\"lock_acquisitions\":%llu,\"superblocks_created\":%llu,"
+                "\"superblocks_adopted\":%llu,\"superblocks_adopted_remote\":%llu,"
+                "\"superblocks_donated\":%llu,\"threads_moved_in\":%llu,"
+                "\"migration_bounces\":%llu,\"slack\":%zu,\"superblocks\":[",
+                i ? "," : "", i, heap->_node, heap->_bytesUsed, heap->_bytesAvailable,
+                heap->_counters._lockAcquisitions, heap->_counters._superblocksCreated,
+                heap->_counters._superblocksAdopted, heap->_counters._superblocksAdoptedRemote,
+                heap->_counters._superblocksDonated, heap->_counters._threadsMovedIn,
+                heap->_counters._migrationBounces, heap->_slack);
+        for (j = 0; j < NUMBER_OF_SIZE_CLASSES; j++) {
+            statsAppend(buffer, length, &written, "%s%u", j ? "," : "", heap->_superblocks[j]);
+        }
+        statsAppend(buffer, length, &written, "]}");
+    }
+    statsAppend(buffer, length, &written,
+            "],\"migrations\":%llu,\"large_allocations\":%llu,\"large_frees\":%llu,"
+            "\"large_bytes_mapped\":%llu,\"mmap_calls\":%llu,\"munmap_calls\":%llu,"
+            "\"core_bytes_mapped\":%llu,\"superblocks_purged\":%llu,"
+            "\"lock_acquisitions\":%llu}",
+            stats._migrations, stats._largeAllocations, stats._largeFrees,
+            stats._largeBytesMapped, stats._mmapCalls, stats._munmapCalls,
+            stats._coreBytesMapped, stats._superblocksPurged,
+            stats._lockAcquisitions);
+
+    return written;
+}
+
+static void addSuperblock(const mtmm_superblock_info_t *info, void *arg)
+{
+    mtmm_fragmentation_t *report = arg;
+    mtmm_class_fragmentation_t *class = &report->_classes[__builtin_ctzl(info->_sizeClassBytes)];
+    size_t used = info->_blocks - info->_freeBlocks;
+    size_t bytes = info->_bytes;
+    size_t internal = used * info->_blockBytes - info->_bytesRequested;
+    size_t external = used ? info->_freeBlocks * info->_blockBytes : 0;
+
+    /* empty, then quarters rounded up */
+    class->_fullness[used ? (4 * used + info->_blocks - 1) / info->_blocks : 0]++;
+    class->_blocksUsed += used;
+    class->_blocksFree += info->_freeBlocks;
+    class->_bytesRequested += info->_bytesRequested;
+    class->_internalWaste += internal;
+    class->_externalWaste += external;
+
+    report->_superblocks++;
+    report->_superblockBytes += bytes;
+    report->_bytesRequested += info->_bytesRequested;
+    report->_internalWaste += internal;
+    report->_externalWaste += external;
+    report->_overhead += bytes - info->_blocks * info->_blockBytes;
+    if (IS_GLOBAL_HEAP_IX(info->_heap)) {
+        report->_strandedBytes += bytes;
+        report->_strandedBytesUsed += used * info->_blockBytes;
+    }
+}
+
+void mtmm_fragmentation(mtmm_fragmentation_t *report)
+{
+    memset(report, 0, sizeof(*report));
+    mtmm_heap_walk(addSuperblock, report);
+}
+
+int mtmm_fragmentation_report(char *buffer, size_t length)
+{
+    mtmm_fragmentation_t report;
+    mtmm_class_fragmentation_t *class;
+    int written = 0;
+    unsigned int i, j;
+
+    mtmm_fragmentation(&report);
+
+    statsAppend(buffer, length, &written,
+            "superblocks %u bytes %zu requested %zu internal %zu external %zu overhead %zu"
+            " stranded %zu stranded_used %zu\n",
+            report._superblocks, report._superblockBytes, report._bytesRequested,
+            report._internalWaste, report._externalWaste, report._overhead,
+            report._strandedBytes, report._strandedBytesUsed);
+    for (i = 0; i < NUMBER_OF_SIZE_CLASSES; i++) {
+        class = &report._classes[i];
+        if (!class->_blocksUsed && !class->_blocksFree)
+            continue;
+        statsAppend(buffer, length, &written, "class %u fullness", 1U << i);
+        for (j = 0; j < MTMM_FULLNESS_BINS; j++)
+            statsAppend(buffer, length, &written, "%c%u", j ? '/' : ' ', class->_fullness[j]);
+        statsAppend(buffer, length, &written,
+                " blocks %zu/%zu requested %zu internal %zu external %zu\n",
+                class->_blocksUsed, class->_blocksUsed + class->_blocksFree,
+                class->_bytesRequested, class->_internalWaste, class->_externalWaste);
+    }
+
+    return written;
+}
@@ -0,0 +1,31 @@
+/*
+ * stats.h
+ *
+ *      Allocator wide counters for events that are not tied to a heap (large
+ *      allocations, calls to the OS). They only change on paths that already
+ *      make a system call, so relaxed atomics are cheap enough. Heap level
+ *      counters live in cpuheap_t and are updated under the heap lock.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+typedef struct {
+    unsigned long long _largeAllocations, _largeFrees, _largeBytesMapped;
+    unsigned long long _mmapCalls, _munmapCalls;
+    unsigned long long _coreBytesMapped, _superblocksPurged;
+} core_counters_t;
+
+extern core_counters_t coreCounters;
+
+#define STATS_ADD(counter, n) __atomic_fetch_add(&coreCounters.counter, (n), __ATOMIC_RELAXED)
+#define STATS_SUB(counter, n) __atomic_fetch_sub(&coreCounters.counter, (n), __ATOMIC_RELAXED)
+#define STATS_READ(counter) __atomic_load_n(&coreCounters.counter, __ATOMIC_RELAXED)
+
+/* report formatting helper - appends to buffer at *written, snprintf style */
+void statsAppend(char *buffer, size_t length, int *written, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,39 @@
+/*
+ *  test-batch-soft-limit
+ *
+ *  mtmm_malloc_batch() must honour the soft limit like malloc(): a batch that
+ *  maps superblocks past the limit runs the pressure callback.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mtmm.h"
+
+#define BLOCKS 200000
+
+static void *blocks[BLOCKS];
+static unsigned int callbacks;
+
+static void onPressure(size_t footprint, size_t limit, void *arg)
+{
+    callbacks++;
+}
+
+int main(void)
+{
+    size_t got;
+
+    mtmm_set_pressure_callback(onPressure, NULL);
+    mtmm_set_soft_limit(1 << 20);
+
+    got = mtmm_malloc_batch(64, BLOCKS, blocks);
+    if (got != BLOCKS || callbacks == 0) {
+        printf("FAIL test-batch-soft-limit: %zu blocks, %u pressure callbacks\n", got, callbacks);
+        return 1;
+    }
+
+    mtmm_free_batch(blocks, got);
+    printf("ok test-batch-soft-limit\n");
+    return 0;
+}
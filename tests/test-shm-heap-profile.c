@@ -0,0 +1,101 @@
+/*
+ *  test-shm-heap-profile
+ *
+ *  Built against libmtmm-heapprof.a: with every allocation sampled, blocks of a
+ *  shared memory heap, large ones included, are still freed whole, by the
+ *  process that allocated them and by another one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mtmm.h"
+
+#define SEGMENT (8UL << 20)
+#define ROUNDS 200
+#define LARGE 4
+#define SMALL 100
+
+static void *large[LARGE], *small[SMALL];
+
+/* fill the segment with blocks, false if it ran out */
+static int allocate(void)
+{
+    int i;
+
+    for (i = 0; i < LARGE; i++) {
+        if (!(large[i] = mtmm_shm_malloc(1 << 20)))
+            return 0;
+        memset(large[i], i, 1 << 20);
+    }
+    for (i = 0; i < SMALL; i++) {
+        if (!(small[i] = mtmm_shm_malloc(48)))
+            return 0;
+    }
+    return 1;
+}
+
+/* a free range of the address space to attach at, whatever the word size */
+static void *freeAddress(void)
+{
+    void *address = mmap(NULL, SEGMENT, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (address == MAP_FAILED)
+        return NULL;
+    munmap(address, SEGMENT);
+    return address;
+}
+
+static void release(void)
+{
+    int i;
+
+    for (i = 0; i < LARGE; i++)
+        free(large[i]);
+    for (i = 0; i < SMALL; i++)
+        free(small[i]);
+}
+
+int main(void)
+{
+    char name[64];
+    int round, status;
+
+    snprintf(name, sizeof(name), "/mtmm-test-%d", (int) getpid());
+    shm_unlink(name);
+    if (mtmm_shm_attach(name, freeAddress(), SEGMENT)) {
+        perror("mtmm_shm_attach");
+        return 1;
+    }
+    shm_unlink(name);
+    mtmm_heap_profile_set_rate(1);
+
+    for (round = 0; round < ROUNDS; round++) {
+        if (!allocate()) {
+            printf("FAIL test-shm-heap-profile: segment exhausted in round %d\n", round);
+            return 1;
+        }
+        if (round % 2) {
+            release();
+            continue;
+        }
+
+        /* the other half of the rounds are freed by a child process */
+        if (fork() == 0) {
+            release();
+            _exit(0);
+        }
+        if (wait(&status) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("FAIL test-shm-heap-profile: child freeing round %d died\n", round);
+            return 1;
+        }
+    }
+
+    mtmm_shm_detach();
+    printf("ok test-shm-heap-profile\n");
+    return 0;
+}
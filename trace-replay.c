@@ -0,0 +1,329 @@
+/*
+ *  trace-replay
+ *
+ *  Re-executes an allocation trace recorded by libmtmm-trace.a against whatever
+ *  allocator the binary is linked with (trace-replay uses libmtmm.a,
+ *  trace-replay-sys the system allocator).
+ *
+ *  Syntax:
+ *  trace-replay tracefile
+ *
+ *  Every recorded thread gets its own replay thread that issues the same calls in
+ *  the same order. Objects are identified across threads, so an object freed by a
+ *  different thread than the one that allocated it is freed by the matching replay
+ *  thread too, after its allocation has been replayed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "trace.h"
+#include "ptbarrier.h"
+
+#define USECSPERSEC 1000000
+#define MAX_THREADS 65536
+
+/* slot value for objects whose replayed allocation returned NULL */
+#define MISSING_OBJECT ((void *) 1)
+
+typedef struct {
+    uint8_t _op;
+    uint64_t _size;
+    /* object produced by the call, 0 for none */
+    uint32_t _id;
+    /* object consumed by the call (free, realloc), 0 for none */
+    uint32_t _oldId;
+} replay_op_t;
+
+typedef struct {
+    unsigned int _tid;
+    replay_op_t *_ops;
+    size_t _length;
+    double _executionTime;
+} replay_thread_t;
+
+typedef struct {
+    uint64_t _ptr;
+    uint32_t _id;
+} live_entry_t;
+
+static void * volatile *slots;
+static replay_thread_t *threads;
+static unsigned int thread_count;
+static pthread_barrier_t barrier;
+
+/* bookkeeping memory is mapped directly so it does not disturb the allocator under test */
+static void *map_memory(size_t size)
+{
+    void *p = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    return p;
+}
+
+static int compare_records(const void *a, const void *b)
+{
+    const trace_record_t *ra = a, *rb = b;
+
+    if (ra->_timestamp != rb->_timestamp)
+        return ra->_timestamp < rb->_timestamp ? -1 : 1;
+    return 0;
+}
+
+static size_t hash_ptr(uint64_t ptr, size_t mask)
+{
+    return (size_t) ((ptr >> 3) * 0x9E3779B97F4A7C15ULL) & mask;
+}
+
+static live_entry_t *live_find(live_entry_t *table, size_t mask, uint64_t ptr)
+{
+    size_t i = hash_ptr(ptr, mask);
+
+    while (table[i]._ptr != 0 && table[i]._ptr != ptr)
+        i = (i + 1) & mask;
+    return &table[i];
+}
+
+/* remove an entry keeping linear probing chains intact */
+static void live_remove(live_entry_t *table, size_t mask, live_entry_t *entry)
+{
+    size_t hole = entry - table, i = hole, home;
+
+    table[hole]._ptr = 0;
+    for (i = (i + 1) & mask; table[i]._ptr != 0; i = (i + 1) & mask) {
+        home = hash_ptr(table[i]._ptr, mask);
+        if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i)) {
+            table[hole] = table[i];
+            table[i]._ptr = 0;
+            hole = i;
+        }
+    }
+}
+
+/* consume the live object named by ptr, returns 0 if it was not allocated in the trace */
+static uint32_t take_object(live_entry_t *table, size_t mask, uint64_t ptr)
+{
+    live_entry_t *entry;
+    uint32_t id;
+
+    if (ptr == 0)
+        return 0;
+    entry = live_find(table, mask, ptr);
+    if (entry->_ptr == 0)
+        return 0;
+    id = entry->_id;
+    live_remove(table, mask, entry);
+    return id;
+}
+
+static void put_object(live_entry_t *table, size_t mask, uint64_t ptr, uint32_t id)
+{
+    live_entry_t *entry = live_find(table, mask, ptr);
+
+    entry->_ptr = ptr;
+    entry->_id = id;
+}
+
+static void load_trace(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    trace_record_t *records;
+    live_entry_t *live;
+    unsigned int *thread_index;
+    size_t count, i, mask, tableSize = 1;
+    uint32_t next_id = 1, id, old_id;
+    replay_op_t *op;
+    replay_thread_t *thread;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+    count = st.st_size / sizeof(trace_record_t);
+
+    records = map_memory(count * sizeof(trace_record_t));
+    if (read(fd, records, count * sizeof(trace_record_t)) != (ssize_t) (count * sizeof(trace_record_t))) {
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+
+    /* per-thread buffers reach the file in flush order, restore the call order */
+    qsort(records, count, sizeof(trace_record_t), compare_records);
+
+    while (tableSize < 2 * count)
+        tableSize <<= 1;
+    mask = tableSize - 1;
+    live = map_memory(tableSize * sizeof(live_entry_t));
+
+    thread_index = map_memory(MAX_THREADS * sizeof(unsigned int));
+    threads = map_memory(MAX_THREADS * sizeof(replay_thread_t));
+    for (i = 0; i < count; i++) {
+        if (thread_index[records[i]._threadId] == 0) {
+            thread_index[records[i]._threadId] = ++thread_count;
+            threads[thread_count - 1]._tid = records[i]._threadId;
+        }
+        threads[thread_index[records[i]._threadId] - 1]._length++;
+    }
+    for (i = 0; i < thread_count; i++) {
+        threads[i]._ops = map_memory(threads[i]._length * sizeof(replay_op_t));
+        threads[i]._length = 0;
+    }
+
+    /* name every object by a sequential id, in call order */
+    for (i = 0; i < count; i++) {
+        id = old_id = 0;
+        switch (records[i]._op) {
+        case TRACE_OP_MALLOC:
+        case TRACE_OP_CALLOC:
+            if (records[i]._ptr == 0)
+                continue;
+            id = next_id++;
+            break;
+        case TRACE_OP_FREE:
+            old_id = take_object(live, mask, records[i]._ptr);
+            if (old_id == 0)
+                continue;
+            break;
+        case TRACE_OP_REALLOC:
+            old_id = take_object(live, mask, records[i]._oldPtr);
+            if (records[i]._ptr != 0)
+                id = next_id++;
+            if (id == 0 && old_id == 0)
+                continue;
+            break;
+        default:
+            fprintf(stderr, "corrupt trace record %zu\n", i);
+            exit(1);
+        }
+        if (id != 0)
+            put_object(live, mask, records[i]._ptr, id);
+
+        thread = &threads[thread_index[records[i]._threadId] - 1];
+        op = &thread->_ops[thread->_length++];
+        op->_op = records[i]._op;
+        op->_size = records[i]._size;
+        op->_id = id;
+        op->_oldId = old_id;
+    }
+
+    slots = map_memory(next_id * sizeof(void *));
+    printf("Trace: %s, Records: %zu, Objects: %u, Threads: %u\n", path, count, next_id - 1, thread_count);
+}
+
+/* wait until another replay thread has produced the object */
+static void *wait_object(uint32_t id)
+{
+    void *p;
+
+    while ((p = __atomic_load_n(&slots[id], __ATOMIC_ACQUIRE)) == NULL)
+        sched_yield();
+    return p;
+}
+
+static void publish_object(uint32_t id, void *p)
+{
+    __atomic_store_n(&slots[id], p ? p : MISSING_OBJECT, __ATOMIC_RELEASE);
+}
+
+static void *run_replay(void *arg)
+{
+    replay_thread_t *thread = arg;
+    struct timeval start, end;
+    size_t i;
+    void *p;
+
+    pthread_barrier_wait(&barrier);
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < thread->_length; i++) {
+        replay_op_t *op = &thread->_ops[i];
+
+        switch (op->_op) {
+        case TRACE_OP_MALLOC:
+            publish_object(op->_id, malloc(op->_size));
+            break;
+        case TRACE_OP_CALLOC:
+            publish_object(op->_id, calloc(1, op->_size));
+            break;
+        case TRACE_OP_FREE:
+            p = wait_object(op->_oldId);
+            if (p != MISSING_OBJECT)
+                free(p);
+            break;
+        case TRACE_OP_REALLOC:
+            p = op->_oldId ? wait_object(op->_oldId) : NULL;
+            if (p == MISSING_OBJECT)
+                p = NULL;
+            if (op->_id == 0) {
+                free(p);
+            } else {
+                publish_object(op->_id, realloc(p, op->_size));
+            }
+            break;
+        }
+    }
+
+    gettimeofday(&end, NULL);
+    thread->_executionTime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / (double) USECSPERSEC;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t *pthreads;
+    struct timeval start, end;
+    unsigned int i;
+    size_t operations = 0;
+    double sum = 0.0, stddev = 0.0, average, wall;
+
+    if (argc != 2) {
+        printf("Syntax: %s tracefile\n", argv[0]);
+        return 1;
+    }
+
+    load_trace(argv[1]);
+    if (thread_count == 0)
+        return 0;
+
+    pthreads = map_memory(thread_count * sizeof(pthread_t));
+    pthread_barrier_init(&barrier, NULL, thread_count + 1);
+
+    printf("Starting replay...\n");
+    for (i = 0; i < thread_count; i++) {
+        operations += threads[i]._length;
+        if (pthread_create(&pthreads[i], NULL, run_replay, &threads[i]))
+            printf("failed.\n");
+    }
+
+    gettimeofday(&start, NULL);
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < thread_count; i++)
+        pthread_join(pthreads[i], NULL);
+    gettimeofday(&end, NULL);
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / (double) USECSPERSEC;
+
+    for (i = 0; i < thread_count; i++)
+        sum += threads[i]._executionTime;
+    average = sum / thread_count;
+    for (i = 0; i < thread_count; i++)
+        stddev += (threads[i]._executionTime - average) * (threads[i]._executionTime - average);
+    stddev = thread_count > 1 ? sqrt(stddev / (thread_count - 1)) : 0.0;
+
+    printf("Replayed %zu operations in %f seconds (%.1f ns/op).\n", operations, wall, wall * 1e9 / operations);
+    printf("Average thread execution time = %f seconds, standard deviation = %f.\n", average, stddev);
+    return 0;
+}
@@ -0,0 +1,130 @@
+/*
+ *
+ *      This module records allocation traces. Records are kept in a per-thread buffer
+ *      and written to the trace file when the buffer fills, when the thread exits and
+ *      at process exit. Nothing here may allocate, since it runs inside malloc/free.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mtmm.h"
+#include "trace.h"
+#include "assert_static.h"
+
+#ifdef MTMM_TRACE
+
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t traceFileLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t traceThreadKey;
+static int traceFd = -1;
+static unsigned int traceThreadCount;
+
+static __thread trace_record_t threadBuffer[TRACE_BUFFER_RECORDS];
+static __thread unsigned int threadBufferLength;
+static __thread unsigned int threadId;
+
+static void trace_init(void);
+static void trace_flush_thread(void);
+static void trace_thread_exit(void *unused);
+static void trace_process_exit(void);
+
+void traceRecord(trace_op_t op, size_t size, void *ptr, void *oldPtr)
+{
+    trace_record_t *record = NULL;
+    struct timespec now;
+
+    pthread_once(&traceOnce, trace_init);
+    if (traceFd == -1) {
+        return;
+    }
+
+    if (threadId == 0) {
+        /* first record of this thread - register it for the exit flush */
+        threadId = __atomic_add_fetch(&traceThreadCount, 1, __ATOMIC_RELAXED);
+        pthread_setspecific(traceThreadKey, threadBuffer);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    record = &threadBuffer[threadBufferLength++];
+    record->_timestamp = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->_ptr = (uintptr_t) ptr;
+    record->_oldPtr = (uintptr_t) oldPtr;
+    record->_size = size;
+    record->_threadId = threadId;
+    record->_op = op;
+    memset(record->_reserved, 0, sizeof(record->_reserved));
+
+    if (threadBufferLength == TRACE_BUFFER_RECORDS) {
+        trace_flush_thread();
+    }
+}
+
+static void trace_init(void)
+{
+    const char *path = getenv("MTMM_TRACE_FILE");
+
+    if (path == NULL) {
+        path = TRACE_DEFAULT_FILE;
+    }
+
+    traceFd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (traceFd == -1) {
+        /* tracing is best effort - run untraced */
+        return;
+    }
+
+    assert(pthread_key_create(&traceThreadKey, trace_thread_exit) == 0);
+    atexit(trace_process_exit);
+}
+
+static void trace_flush_thread(void)
+{
+    const char *buffer = (const char *) threadBuffer;
+    size_t length = threadBufferLength * sizeof(trace_record_t);
+    ssize_t written = 0;
+
+    if (threadBufferLength == 0) {
+        return;
+    }
+
+    /* whole buffers are written under the lock so records are never interleaved */
+    assert(pthread_mutex_lock(&traceFileLock) == 0);
+    while (length > 0) {
+        written = write(traceFd, buffer, length);
+        if (written <= 0) {
+            break;
+        }
+        buffer += written;
+        length -= written;
+    }
+    assert(pthread_mutex_unlock(&traceFileLock) == 0);
+
+    threadBufferLength = 0;
+}
+
+static void trace_thread_exit(void *unused)
+{
+    trace_flush_thread();
+}
+
+static void trace_process_exit(void)
+{
+    trace_flush_thread();
+}
+
+#endif /* MTMM_TRACE */
+
+void mtmm_trace_flush(void)
+{
+#ifdef MTMM_TRACE
+    if (traceFd != -1) {
+        trace_flush_thread();
+    }
+#endif
+}
@@ -0,0 +1,68 @@
+/*
+ * trace.h
+ *
+ *      Allocation trace records. When the library is compiled with MTMM_TRACE, every
+ *      malloc/free/realloc/calloc call appends a record to a per-thread buffer, which
+ *      is flushed to the file named by the MTMM_TRACE_FILE environment variable
+ *      (mtmm.trace by default). trace-replay re-executes such a file.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRACE_DEFAULT_FILE "mtmm.trace"
+
+/* number of records buffered per thread before they are written out */
+#define TRACE_BUFFER_RECORDS 256
+
+typedef enum {
+    TRACE_OP_MALLOC = 1,
+    TRACE_OP_FREE,
+    TRACE_OP_REALLOC,
+    TRACE_OP_CALLOC
+} trace_op_t;
+
+/*
+ * one traced call - 40 bytes on disk.
+ * pointers identify objects: a pointer returned by an allocation names the object
+ * until the record that frees (or reallocates) it.
+ */
+typedef struct {
+    /* CLOCK_MONOTONIC nanoseconds, orders records across threads */
+    uint64_t _timestamp;
+
+    /* returned pointer for allocations, freed pointer for free */
+    uint64_t _ptr;
+
+    /* pointer passed to realloc, 0 otherwise */
+    uint64_t _oldPtr;
+
+    /* requested size in bytes (nmemb * size for calloc), 64 bits so that
+       requests of 4GB and more are kept whole */
+    uint64_t _size;
+
+    /* small sequential id of the calling thread */
+    uint16_t _threadId;
+
+    uint8_t _op;
+    uint8_t _reserved[5];
+} trace_record_t;
+
+_Static_assert(sizeof(trace_record_t) == 40, "trace records are 40 bytes on disk");
+
+#ifdef MTMM_TRACE
+
+void traceRecord(trace_op_t op, size_t size, void *ptr, void *oldPtr);
+
+#define TRACE_RECORD(op, size, ptr, oldPtr) traceRecord((op), (size), (ptr), (oldPtr))
+
+#else /* Not MTMM_TRACE */
+
+#define TRACE_RECORD(op, size, ptr, oldPtr)
+
+#endif /* MTMM_TRACE */
+
+#endif /* __TRACE_H__ */